@@ -24,8 +24,23 @@
  * IN THE SOFTWARE.
  */
 
+/* use `make bench` to run the benchmark; see `bench-bin -h` for the options */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* for the CPU affinity functions */
+#include <sched.h>
+#endif
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
 #include "picohttpparser.h"
 
 #define REQ                                                                                                                        \
@@ -44,22 +59,676 @@
     "__utmz=xxxxxxxxx.xxxxxxxxxx.x.x.utmccn=(referral)|utmcsr=reader.livedoor.com|utmcct=/reader/|utmcmd=referral\r\n"             \
     "\r\n"
 
-int main(void)
-{
-    const char *method;
-    size_t method_len;
-    const char *path;
-    size_t path_len;
-    int minor_version;
-    struct phr_header headers[32];
-    size_t num_headers;
-    int i, ret;
-
-    for (i = 0; i < 10000000; i++) {
-        num_headers = sizeof(headers) / sizeof(headers[0]);
-        ret = phr_parse_request(REQ, sizeof(REQ) - 1, &method, &method_len, &path, &path_len, &minor_version, headers, &num_headers,
-                                0);
-        assert(ret == sizeof(REQ) - 1);
+#define API_REQ "POST /v1/items HTTP/1.1\r\nHost: api.example.com\r\nContent-Type: application/json\r\nContent-Length: 0\r\n\r\n"
+
+#define RES                                                                                                                        \
+    "HTTP/1.1 200 OK\r\n"                                                                                                          \
+    "Date: Mon, 23 May 2005 22:38:34 GMT\r\n"                                                                                      \
+    "Content-Type: text/html; charset=UTF-8\r\n"                                                                                   \
+    "Content-Length: 155\r\n"                                                                                                      \
+    "Last-Modified: Wed, 08 Jan 2003 23:11:55 GMT\r\n"                                                                             \
+    "Server: Apache/1.3.3.7 (Unix) (Red-Hat/Linux)\r\n"                                                                            \
+    "ETag: \"3f80f-1b6-3e1cb03b\"\r\n"                                                                                             \
+    "Accept-Ranges: bytes\r\n"                                                                                                     \
+    "Connection: close\r\n"                                                                                                        \
+    "\r\n"
+
+#define MAX_HEADERS 128
+#define PIPELINE_DEPTH 8
+
+/* a message to be parsed */
+struct corpus {
+    const char *name;
+    char *buf;
+    size_t len;
+    int is_response;
+    size_t head_len;    /* length of the request line or the status line and the headers */
+    size_t first_len;   /* length of the request line or the status line */
+    size_t body_off;    /* offset of the chunked body, or zero if not chunked */
+    char *pipelined;    /* the request repeated PIPELINE_DEPTH times */
+    char *work;         /* buffer for the functions that modify the input */
+};
+
+/* an entry point being benchmarked; `run` returns the number of bytes processed, or zero on failure */
+struct entry_point {
+    const char *name;
+    int (*applies)(const struct corpus *c);
+    size_t (*run)(struct corpus *c);
+};
+
+/* the outputs of the parsers; thread-local so that the workers of the scaling benchmark do not share cache lines */
+static __thread const char *method, *path, *msg;
+static __thread size_t method_len, path_len, msg_len, num_headers;
+static __thread int minor_version, status;
+static __thread struct phr_header headers[MAX_HEADERS];
+
+static int is_request(const struct corpus *c)
+{
+    return !c->is_response;
+}
+
+static int is_message(const struct corpus *c)
+{
+    (void)c;
+    return 1;
+}
+
+static int is_chunked(const struct corpus *c)
+{
+    return c->body_off != 0;
+}
+
+static size_t run_find_headers_end(struct corpus *c)
+{
+    return phr_find_headers_end(c->buf, c->len, 0) == (int)c->head_len ? c->head_len : 0;
+}
+
+static size_t run_parse(struct corpus *c)
+{
+    int ret;
+    num_headers = MAX_HEADERS;
+    if (c->is_response) {
+        ret = phr_parse_response(c->buf, c->len, &minor_version, &status, &msg, &msg_len, headers, &num_headers, 0);
+    } else {
+        ret = phr_parse_request(c->buf, c->len, &method, &method_len, &path, &path_len, &minor_version, headers, &num_headers, 0);
+    }
+    return ret == (int)c->head_len ? c->head_len : 0;
+}
+
+static size_t run_parse_headers(struct corpus *c)
+{
+    num_headers = MAX_HEADERS;
+    return phr_parse_headers(c->buf + c->first_len, c->len - c->first_len, headers, &num_headers, 0) ==
+                   (int)(c->head_len - c->first_len)
+               ? c->head_len - c->first_len
+               : 0;
+}
+
+static size_t run_parse_with_ids(struct corpus *c)
+{
+    int header_ids[MAX_HEADERS], ret;
+    num_headers = MAX_HEADERS;
+    if (c->is_response) {
+        ret = phr_parse_response_with_ids(c->buf, c->len, &minor_version, &status, &msg, &msg_len, headers, header_ids,
+                                          &num_headers, 0);
+    } else {
+        ret = phr_parse_request_with_ids(c->buf, c->len, &method, &method_len, &path, &path_len, &minor_version, headers,
+                                         header_ids, &num_headers, 0);
+    }
+    return ret == (int)c->head_len ? c->head_len : 0;
+}
+
+static size_t run_parse_framing(struct corpus *c)
+{
+    struct phr_framing framing;
+    int ret;
+    num_headers = MAX_HEADERS;
+    if (c->is_response) {
+        ret = phr_parse_response_framing(c->buf, c->len, &minor_version, &status, &msg, &msg_len, headers, &num_headers, &framing,
+                                         0);
+    } else {
+        ret = phr_parse_request_framing(c->buf, c->len, &method, &method_len, &path, &path_len, &minor_version, headers,
+                                        &num_headers, &framing, 0);
+    }
+    return ret == (int)c->head_len ? c->head_len : 0;
+}
+
+static size_t run_parse_compact(struct corpus *c)
+{
+    struct phr_header_compact compact[MAX_HEADERS];
+    int ret;
+    num_headers = MAX_HEADERS;
+    if (c->is_response) {
+        ret = phr_parse_response_compact(c->buf, c->len, &minor_version, &status, &msg, &msg_len, compact, &num_headers, 0);
+    } else {
+        ret = phr_parse_request_compact(c->buf, c->len, &method, &method_len, &path, &path_len, &minor_version, compact,
+                                        &num_headers, 0);
+    }
+    return ret == (int)c->head_len ? c->head_len : 0;
+}
+
+static size_t run_parse_incremental(struct corpus *c)
+{
+    struct phr_parse_state state = {0};
+    int ret;
+    num_headers = MAX_HEADERS;
+    if (c->is_response) {
+        ret = phr_parse_response_incremental(&state, c->buf, c->len, &minor_version, &status, &msg, &msg_len, headers,
+                                             &num_headers);
+    } else {
+        ret = phr_parse_request_incremental(&state, c->buf, c->len, &method, &method_len, &path, &path_len, &minor_version, headers,
+                                            &num_headers);
+    }
+    return ret == (int)c->head_len ? c->head_len : 0;
+}
+
+static size_t run_parse_iov(struct corpus *c)
+{
+    /* split the input in the middle of the headers; the work buffer is used as the scratch, as it can hold any line of the input */
+    struct phr_iovec iov[2] = {{c->buf, c->head_len / 2}, {c->buf + c->head_len / 2, c->len - c->head_len / 2}};
+    int ret;
+    num_headers = MAX_HEADERS;
+    if (c->is_response) {
+        ret = phr_parse_response_iov(iov, 2, c->work, c->len, &minor_version, &status, &msg, &msg_len, headers, &num_headers);
+    } else {
+        ret = phr_parse_request_iov(iov, 2, c->work, c->len, &method, &method_len, &path, &path_len, &minor_version, headers,
+                                    &num_headers);
+    }
+    return ret == (int)c->head_len ? c->head_len : 0;
+}
+
+static size_t run_parse_selective(struct corpus *c)
+{
+    static const char *const wanted[] = {"host", "cookie", "content-length", "transfer-encoding"};
+    int ret;
+    num_headers = MAX_HEADERS;
+    if (c->is_response) {
+        ret = phr_parse_response_selective(c->buf, c->len, &minor_version, &status, &msg, &msg_len, wanted, 4, headers,
+                                           &num_headers, 0);
+    } else {
+        ret = phr_parse_request_selective(c->buf, c->len, &method, &method_len, &path, &path_len, &minor_version, wanted, 4,
+                                          headers, &num_headers, 0);
+    }
+    return ret == (int)c->head_len ? c->head_len : 0;
+}
+
+static size_t run_parse_lazy(struct corpus *c)
+{
+    struct phr_lazy_headers lazy;
+    int ret;
+    if (c->is_response) {
+        ret = phr_parse_response_lazy(c->buf, c->len, &minor_version, &status, &msg, &msg_len, &lazy, 0);
+    } else {
+        ret = phr_parse_request_lazy(c->buf, c->len, &method, &method_len, &path, &path_len, &minor_version, &lazy, 0);
+    }
+    return ret == (int)c->head_len ? c->head_len : 0;
+}
+
+static size_t run_parse_requests_batch(struct corpus *c)
+{
+    struct phr_request requests[PIPELINE_DEPTH];
+    size_t num_requests = PIPELINE_DEPTH;
+    num_headers = MAX_HEADERS;
+    return phr_parse_requests_batch(c->pipelined, c->head_len * PIPELINE_DEPTH, requests, &num_requests, headers, &num_headers) ==
+                   (int)(c->head_len * PIPELINE_DEPTH)
+               ? c->head_len * PIPELINE_DEPTH
+               : 0;
+}
+
+static size_t run_decode_chunked(struct corpus *c)
+{
+    struct phr_chunked_decoder decoder = {0};
+    size_t bufsz = c->len - c->body_off;
+    /* the input is restored every time, as the function decodes in place */
+    memcpy(c->work, c->buf + c->body_off, bufsz);
+    return phr_decode_chunked(&decoder, c->work, &bufsz) >= 0 ? c->len - c->body_off : 0;
+}
+
+static size_t run_decode_chunked_metadata(struct corpus *c)
+{
+    struct phr_chunked_decoder decoder = {0};
+    struct phr_chunked_span spans[64], exts[64];
+    struct phr_header trailers[8];
+    size_t off = c->body_off, bufsz, num_spans, num_exts, num_trailers;
+    ssize_t ret;
+    do {
+        bufsz = c->len - off;
+        num_spans = sizeof(spans) / sizeof(spans[0]);
+        num_exts = sizeof(exts) / sizeof(exts[0]);
+        num_trailers = sizeof(trailers) / sizeof(trailers[0]);
+        ret = phr_decode_chunked_metadata(&decoder, c->buf + off, &bufsz, spans, &num_spans, exts, &num_exts, trailers,
+                                          &num_trailers);
+        off += bufsz;
+    } while (ret == -2 && off != c->len);
+    return ret >= 0 ? c->len - c->body_off : 0;
+}
+
+static size_t run_decode_chunked_discard(struct corpus *c)
+{
+    struct phr_chunked_decoder decoder = {0};
+    size_t bufsz = c->len - c->body_off;
+    decoder.discard = 1;
+    return phr_decode_chunked(&decoder, c->buf + c->body_off, &bufsz) >= 0 ? c->len - c->body_off : 0;
+}
+
+static size_t run_decode_chunked_spans(struct corpus *c)
+{
+    struct phr_chunked_decoder decoder = {0};
+    struct phr_chunked_span spans[64];
+    size_t off = c->body_off, bufsz, num_spans;
+    ssize_t ret;
+    do {
+        bufsz = c->len - off;
+        num_spans = sizeof(spans) / sizeof(spans[0]);
+        ret = phr_decode_chunked_spans(&decoder, c->buf + off, &bufsz, spans, &num_spans);
+        off += bufsz;
+    } while (ret == -2 && off != c->len);
+    return ret >= 0 ? c->len - c->body_off : 0;
+}
+
+static const struct entry_point entry_points[] = {{"phr_find_headers_end", is_message, run_find_headers_end},
+                                                  {"phr_parse_request/response", is_message, run_parse},
+                                                  {"phr_parse_headers", is_message, run_parse_headers},
+                                                  {"phr_parse_*_with_ids", is_message, run_parse_with_ids},
+                                                  {"phr_parse_*_framing", is_message, run_parse_framing},
+                                                  {"phr_parse_*_compact", is_message, run_parse_compact},
+                                                  {"phr_parse_*_incremental", is_message, run_parse_incremental},
+                                                  {"phr_parse_*_iov", is_message, run_parse_iov},
+                                                  {"phr_parse_*_selective", is_message, run_parse_selective},
+                                                  {"phr_parse_*_lazy", is_message, run_parse_lazy},
+                                                  {"phr_parse_requests_batch", is_request, run_parse_requests_batch},
+                                                  {"phr_decode_chunked (+memcpy)", is_chunked, run_decode_chunked},
+                                                  {"phr_decode_chunked_spans", is_chunked, run_decode_chunked_spans},
+                                                  {"phr_decode_chunked_metadata", is_chunked, run_decode_chunked_metadata},
+                                                  {"phr_decode_chunked (discard)", is_chunked, run_decode_chunked_discard},
+                                                  {NULL}};
+
+static void setup_corpus(struct corpus *c, const char *name, char *buf, size_t len)
+{
+    struct phr_framing framing;
+    int ret;
+    size_t i;
+
+    c->name = name;
+    c->buf = buf;
+    c->len = len;
+    c->is_response = len >= 5 && memcmp(buf, "HTTP/", 5) == 0;
+    num_headers = MAX_HEADERS;
+    if (c->is_response) {
+        ret = phr_parse_response_framing(buf, len, &minor_version, &status, &msg, &msg_len, headers, &num_headers, &framing, 0);
+    } else {
+        ret = phr_parse_request_framing(buf, len, &method, &method_len, &path, &path_len, &minor_version, headers, &num_headers,
+                                        &framing, 0);
+    }
+    if (ret <= 0) {
+        fprintf(stderr, "%s: failed to parse the message (%d)\n", name, ret);
+        exit(1);
+    }
+    c->head_len = (size_t)ret;
+    c->first_len = (size_t)((const char *)memchr(buf, '\n', len) + 1 - buf);
+    c->body_off = (framing.flags & PHR_FRAMING_CHUNKED) != 0 ? c->head_len : 0;
+    c->pipelined = malloc(c->head_len * PIPELINE_DEPTH);
+    for (i = 0; i != PIPELINE_DEPTH; ++i)
+        memcpy(c->pipelined + c->head_len * i, buf, c->head_len);
+    c->work = malloc(len);
+}
+
+static char *load_file(const char *fn, size_t *len)
+{
+    FILE *fp;
+    char *buf = NULL;
+    size_t capacity = 0;
+
+    if ((fp = fopen(fn, "rb")) == NULL) {
+        perror(fn);
+        exit(1);
+    }
+    for (*len = 0; !feof(fp);) {
+        if (*len == capacity)
+            buf = realloc(buf, capacity = capacity * 2 + 4096);
+        *len += fread(buf + *len, 1, capacity - *len, fp);
+    }
+    fclose(fp);
+    return buf;
+}
+
+/* builds a chunked response carrying `num_chunks` chunks of `chunk_len` bytes */
+static char *build_chunked_response(size_t chunk_len, size_t num_chunks, size_t *len)
+{
+    static const char head[] = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nTransfer-Encoding: chunked\r\n\r\n";
+    char *buf = malloc(sizeof(head) + num_chunks * (chunk_len + 32) + 8);
+    size_t i;
+
+    memcpy(buf, head, sizeof(head) - 1);
+    *len = sizeof(head) - 1;
+    for (i = 0; i != num_chunks; ++i) {
+        *len += sprintf(buf + *len, "%zx\r\n", chunk_len);
+        memset(buf + *len, 'x', chunk_len);
+        *len += chunk_len;
+        memcpy(buf + *len, "\r\n", 2);
+        *len += 2;
+    }
+    memcpy(buf + *len, "0\r\n\r\n", 5);
+    *len += 5;
+    return buf;
+}
+
+static char *build_large_cookie_request(size_t cookie_len, size_t *len)
+{
+    static const char head[] = "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\nCookie: ";
+    char *buf = malloc(sizeof(head) + cookie_len + 4);
+    size_t i;
+
+    memcpy(buf, head, sizeof(head) - 1);
+    for (i = 0; i != cookie_len; ++i)
+        buf[sizeof(head) - 1 + i] = "session=0123456789abcdef; "[i % 26];
+    memcpy(buf + sizeof(head) - 1 + cookie_len, "\r\n\r\n", 4);
+    *len = sizeof(head) - 1 + cookie_len + 4;
+    return buf;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long ticks(void)
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* checks if the entry point succeeds on the corpus, as some of them cannot handle all inputs (e.g., phr_parse_requests_batch
+ * cannot pipeline the heads of requests carrying bodies) */
+static int is_runnable(struct corpus *c, const struct entry_point *ep)
+{
+    if (ep->run(c) != 0)
+        return 1;
+    fprintf(stderr, "%s: skipping %s, as it fails on the input\n", c->name, ep->name);
+    return 0;
+}
+
+static int cmp_double(const void *x, const void *y)
+{
+    double a = *(const double *)x, b = *(const double *)y;
+    return a < b ? -1 : a > b;
+}
+
+/* runs an entry point in batches lasting at least `min_batch_time` seconds, and reports the percentiles of the time spent per op */
+static void bench(struct corpus *c, const struct entry_point *ep, size_t num_samples, double min_batch_time)
+{
+    double *samples = malloc(sizeof(*samples) * num_samples), elapsed, total_time = 0;
+    unsigned long long total_ticks = 0, t0;
+    size_t batch = 1, i, j, bytes = 0, total_bytes = 0;
+
+    bytes = ep->run(c);
+
+    /* find the batch size */
+    while (1) {
+        elapsed = now();
+        for (j = 0; j != batch; ++j)
+            ep->run(c);
+        if (now() - elapsed >= min_batch_time)
+            break;
+        batch *= 2;
+    }
+
+    for (i = 0; i != num_samples; ++i) {
+        elapsed = now();
+        t0 = ticks();
+        for (j = 0; j != batch; ++j)
+            total_bytes += ep->run(c);
+        total_ticks += ticks() - t0;
+        elapsed = now() - elapsed;
+        total_time += elapsed;
+        samples[i] = elapsed * 1e9 / batch;
+    }
+    qsort(samples, num_samples, sizeof(*samples), cmp_double);
+
+    printf("%-24s %-30s %7zu %9.1f %9.1f %9.1f %10.1f", c->name, ep->name, bytes, samples[num_samples / 2],
+           samples[num_samples * 9 / 10], samples[num_samples * 99 / 100], total_bytes / total_time / 1e6);
+#ifdef HAVE_RDTSC
+    printf(" %8.3f\n", (double)total_ticks / total_bytes);
+#else
+    printf(" %8s\n", "-");
+#endif
+
+    free(samples);
+}
+
+/* state of a worker thread of the scaling benchmark */
+struct worker {
+    pthread_t tid;
+    size_t index;
+    const struct corpus *src;
+    const struct entry_point *ep;
+    double duration;
+    unsigned long long ops;
+    size_t bytes;
+    double elapsed;
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    size_t num_ready;
+    int started;
+} start_gate = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0};
+
+#ifdef __linux__
+static cpu_set_t allowed_cpus;
+#endif
+
+static size_t num_cpus(void)
+{
+    long n;
+#ifdef __linux__
+    if (sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus) == 0)
+        return (size_t)CPU_COUNT(&allowed_cpus);
+#endif
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+}
+
+/* pins the calling thread to the `index`-th CPU that the process is allowed to run on */
+static void pin_thread(size_t index)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    size_t cpu, nth = index % (size_t)CPU_COUNT(&allowed_cpus);
+
+    for (cpu = 0;; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed_cpus) && nth-- == 0)
+            break;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+static void *worker_main(void *_w)
+{
+    struct worker *w = _w;
+    struct corpus c = *w->src;
+    size_t i;
+    double start, now_;
+
+    /* pin first, then copy the corpus, so that the copies are allocated on the memory local to the CPU (first-touch) */
+    pin_thread(w->index);
+    c.buf = malloc(c.len);
+    memcpy(c.buf, w->src->buf, c.len);
+    c.pipelined = malloc(c.head_len * PIPELINE_DEPTH);
+    memcpy(c.pipelined, w->src->pipelined, c.head_len * PIPELINE_DEPTH);
+    c.work = malloc(c.len);
+    memcpy(c.work, c.buf, c.len);
+
+    pthread_mutex_lock(&start_gate.mutex);
+    ++start_gate.num_ready;
+    pthread_cond_broadcast(&start_gate.cond);
+    while (!start_gate.started)
+        pthread_cond_wait(&start_gate.cond, &start_gate.mutex);
+    pthread_mutex_unlock(&start_gate.mutex);
+
+    start = now();
+    do {
+        for (i = 0; i != 64; ++i)
+            w->bytes += w->ep->run(&c);
+        w->ops += 64;
+    } while ((now_ = now()) - start < w->duration);
+    w->elapsed = now_ - start;
+
+    free(c.buf);
+    free(c.pipelined);
+    free(c.work);
+    return NULL;
+}
+
+/* runs an entry point on 1 to `max_threads` pinned threads, each parsing its own copy of the corpus */
+static void bench_scaling(const struct corpus *c, const struct entry_point *ep, size_t max_threads, double duration)
+{
+    struct worker *workers = calloc(max_threads, sizeof(*workers));
+    size_t num_threads = 1, i;
+    double single_rate = 0;
+
+    while (1) {
+        double total_rate = 0, min_rate = 0, total_bytes_rate = 0;
+        memset(workers, 0, sizeof(*workers) * num_threads);
+        start_gate.num_ready = 0;
+        start_gate.started = 0;
+        for (i = 0; i != num_threads; ++i) {
+            workers[i].index = i;
+            workers[i].src = c;
+            workers[i].ep = ep;
+            workers[i].duration = duration;
+            if (pthread_create(&workers[i].tid, NULL, worker_main, workers + i) != 0) {
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+        pthread_mutex_lock(&start_gate.mutex);
+        while (start_gate.num_ready != num_threads)
+            pthread_cond_wait(&start_gate.cond, &start_gate.mutex);
+        start_gate.started = 1;
+        pthread_cond_broadcast(&start_gate.cond);
+        pthread_mutex_unlock(&start_gate.mutex);
+        for (i = 0; i != num_threads; ++i) {
+            double rate;
+            pthread_join(workers[i].tid, NULL);
+            rate = workers[i].ops / workers[i].elapsed;
+            total_rate += rate;
+            total_bytes_rate += workers[i].bytes / workers[i].elapsed;
+            if (i == 0 || rate < min_rate)
+                min_rate = rate;
+        }
+        if (num_threads == 1)
+            single_rate = total_rate;
+        printf("%-24s %-30s %7zu %12.0f %12.0f %12.0f %10.1f %6.1f%%\n", c->name, ep->name, num_threads, total_rate,
+               total_rate / num_threads, min_rate, total_bytes_rate / 1e6, total_rate / (single_rate * num_threads) * 100);
+        if (num_threads == max_threads)
+            break;
+        num_threads = num_threads * 2 < max_threads ? num_threads * 2 : max_threads;
+    }
+
+    free(workers);
+}
+
+static void usage(const char *cmd)
+{
+    printf("Usage: %s [options] [file ...]\n"
+           "Options:\n"
+           "  -k kernel   uses the specified scanning kernel (0: scalar, 1: SSE4.2, 2: AVX2, 3: AVX-512)\n"
+           "  -f name     runs the entry points whose names contain the string\n"
+           "  -n samples  number of samples per entry point (default: 100)\n"
+           "  -t msec     minimum duration of each sample (default: 1)\n"
+           "  -j threads  measures the scaling from 1 to the given number of pinned threads\n"
+           "              (0: number of CPUs) instead of the latency\n"
+           "  -d msec     duration of each run of the scaling benchmark (default: 500)\n"
+           "  -h          prints this help\n"
+           "Each file should contain an HTTP request or response, optionally followed by a\n"
+           "chunked body. Built-in corpora are used if no files are given. The entry points\n"
+           "that fail on a corpus are skipped.\n"
+           "tick/byte is the count of the TSC (which runs at a fixed rate that might differ\n"
+           "from the clock of the core) per byte.\n"
+           "\n",
+           cmd);
+}
+
+int main(int argc, char **argv)
+{
+    struct corpus corpora[64];
+    size_t num_corpora = 0, num_samples = 100, max_threads = 0, len, i;
+    const char *filter = NULL;
+    double min_batch_time = 0.001, duration = 0.5;
+    int scaling = 0;
+    const struct entry_point *ep;
+    char *buf;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "k:f:n:t:j:d:h")) != -1) {
+        switch (ch) {
+        case 'k':
+            if (phr_set_kernel(atoi(optarg)) != 0) {
+                fprintf(stderr, "kernel %s is not available\n", optarg);
+                return 1;
+            }
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'n':
+            if ((num_samples = (size_t)atoi(optarg)) == 0) {
+                fprintf(stderr, "invalid number of samples: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 't':
+            min_batch_time = atof(optarg) / 1000;
+            break;
+        case 'j':
+            scaling = 1;
+            if ((max_threads = (size_t)atoi(optarg)) == 0)
+                max_threads = num_cpus();
+            break;
+        case 'd':
+            duration = atof(optarg) / 1000;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc == 0) {
+        setup_corpus(corpora + num_corpora++, "firefox-request", REQ, sizeof(REQ) - 1);
+        setup_corpus(corpora + num_corpora++, "api-request", API_REQ, sizeof(API_REQ) - 1);
+        buf = build_large_cookie_request(4000, &len);
+        setup_corpus(corpora + num_corpora++, "large-cookie-request", buf, len);
+        setup_corpus(corpora + num_corpora++, "response", RES, sizeof(RES) - 1);
+        buf = build_chunked_response(16, 256, &len);
+        setup_corpus(corpora + num_corpora++, "small-chunks-response", buf, len);
+        buf = build_chunked_response(4096, 16, &len);
+        setup_corpus(corpora + num_corpora++, "large-chunks-response", buf, len);
+    } else {
+        for (i = 0; i != (size_t)argc && num_corpora != sizeof(corpora) / sizeof(corpora[0]); ++i) {
+            buf = load_file(argv[i], &len);
+            setup_corpus(corpora + num_corpora++, argv[i], buf, len);
+        }
+    }
+
+    printf("# kernel: %d\n", phr_get_kernel());
+    if (scaling) {
+        num_cpus(); /* initializes the set of CPUs to pin the threads to */
+        printf("%-24s %-30s %7s %12s %12s %12s %10s %7s\n", "corpus", "entry point", "threads", "ops/s", "ops/s/thread",
+               "min/thread", "MB/s", "effic.");
+        for (i = 0; i != num_corpora; ++i) {
+            for (ep = entry_points; ep->name != NULL; ++ep) {
+                if (!ep->applies(corpora + i) || (filter != NULL && strstr(ep->name, filter) == NULL) ||
+                    !is_runnable(corpora + i, ep))
+                    continue;
+                bench_scaling(corpora + i, ep, max_threads, duration);
+            }
+        }
+        return 0;
+    }
+    printf("%-24s %-30s %7s %9s %9s %9s %10s %8s\n", "corpus", "entry point", "bytes", "ns/op p50", "p90", "p99", "MB/s",
+           "tick/byte");
+    for (i = 0; i != num_corpora; ++i) {
+        for (ep = entry_points; ep->name != NULL; ++ep) {
+            if (!ep->applies(corpora + i) || (filter != NULL && strstr(ep->name, filter) == NULL) || !is_runnable(corpora + i, ep))
+                continue;
+            bench(corpora + i, ep, num_samples, min_batch_time);
+        }
     }
 
     return 0;
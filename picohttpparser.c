@@ -27,9 +27,30 @@
 #include <assert.h>
 #include <stddef.h>
 #include <string.h>
-#ifdef __SSE4_2__
+/* On x86 with GCC or clang, kernels for all instruction sets are built using the target attribute and the fastest one supported by
+ * the CPU is selected at runtime. Elsewhere, the kernels to be built are determined by the compiler flags. */
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || __GNUC__ >= 5) && !defined(PHR_NO_RUNTIME_DISPATCH)
+#define RUNTIME_DISPATCH 1
+#define TARGET(isa) __attribute__((target(isa)))
+#define HAVE_SSE42 1
+#define HAVE_AVX2 1
+#define HAVE_AVX512 1
+#else
+#define TARGET(isa)
+#if defined(__SSE4_2__) || defined(__AVX2__)
+#define HAVE_SSE42 1
+#endif
+#ifdef __AVX2__
+#define HAVE_AVX2 1
+#endif
+#ifdef __AVX512BW__
+#define HAVE_AVX512 1
+#endif
+#endif
+#ifdef HAVE_SSE42
 #ifdef _MSC_VER
-#include <nmmintrin.h>
+#include <intrin.h>
+#include <immintrin.h>
 #else
 #include <x86intrin.h>
 #endif
@@ -46,12 +67,61 @@
 
 #ifdef _MSC_VER
 #define ALIGNED(n) _declspec(align(n))
+#define ALWAYS_INLINE __forceinline
+#define THREAD_LOCAL __declspec(thread)
 #else
 #define ALIGNED(n) __attribute__((aligned(n)))
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#define THREAD_LOCAL __thread
+#endif
+
+#ifdef _MSC_VER
+static __inline unsigned long count_trailing_zeros(unsigned __int64 v)
+{
+    unsigned long r;
+    if (_BitScanForward(&r, (unsigned long)v))
+        return r;
+    _BitScanForward(&r, (unsigned long)(v >> 32));
+    return r + 32;
+}
+#else
+#define count_trailing_zeros(v) __builtin_ctzll(v)
 #endif
 
 #define IS_PRINTABLE_ASCII(c) ((unsigned char)(c)-040u < 0137u)
 
+/* Leniencies that a deployment speaking strict HTTP/1.1 can opt out of at compile time, which removes the corresponding branches
+ * from the parser. PHR_STRICT turns on all of the PHR_REQUIRE_CRLF, PHR_NO_OBS_FOLD and PHR_NO_LEADING_EMPTY_LINE. */
+#ifdef PHR_STRICT
+#define PHR_REQUIRE_CRLF
+#define PHR_NO_OBS_FOLD
+#define PHR_NO_LEADING_EMPTY_LINE
+#endif
+#ifdef PHR_REQUIRE_CRLF
+#define ALLOW_BARE_LF 0
+#else
+#define ALLOW_BARE_LF 1 /* accept LF as a line terminator */
+#endif
+#ifdef PHR_NO_OBS_FOLD
+#define ALLOW_OBS_FOLD 0
+#else
+#define ALLOW_OBS_FOLD 1 /* accept continuation lines, reporting them as headers without names */
+#endif
+#ifdef PHR_NO_LEADING_EMPTY_LINE
+#define SKIP_LEADING_EMPTY_LINE 0
+#else
+#define SKIP_LEADING_EMPTY_LINE 1 /* skip an empty line preceding the request line */
+#endif
+
+/* the counters are compiled out unless PHR_ENABLE_STATS is defined; the argument is still evaluated for silencing the warnings on
+ * unused variables, hence it must not have side effects */
+#ifdef PHR_ENABLE_STATS
+static THREAD_LOCAL struct phr_stats stats;
+#define STATS_ADD(field, n) (stats.field += (n))
+#else
+#define STATS_ADD(field, n) ((void)(n))
+#endif
+
 #define CHECK_EOF()                                                                                                                \
     if (buf == buf_end) {                                                                                                          \
         *ret = -2;                                                                                                                 \
@@ -71,9 +141,8 @@
 #define ADVANCE_TOKEN(tok, toklen)                                                                                                 \
     do {                                                                                                                           \
         const char *tok_start = buf;                                                                                               \
-        static const char ALIGNED(16) ranges2[16] = "\000\040\177\177";                                                            \
         int found2;                                                                                                                \
-        buf = findchar_fast(buf, buf_end, ranges2, 4, &found2);                                                                    \
+        buf = kernel->find_space_or_ctl(buf, buf_end, &found2);                                                                    \
         if (!found2) {                                                                                                             \
             CHECK_EOF();                                                                                                           \
         }                                                                                                                          \
@@ -102,12 +171,124 @@ static const char *token_char_map = "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\
                                     "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
                                     "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
 
-static const char *findchar_fast(const char *buf, const char *buf_end, const char *ranges, size_t ranges_size, int *found)
+/* kinds of characters searched for by the kernels; see `struct scan_kernel` */
+enum { FIND_CTL, FIND_SPACE_OR_CTL, FIND_NON_TOKEN };
+
+#define SWAR_ONES ((uint64_t)0x0101010101010101)
+#define SWAR_HIGH_BITS (SWAR_ONES * 0x80)
+
+/* Returns a word with the MSB of each byte set if the corresponding byte of `x` is below `n` (n <= 0x80). Unlike the well-known
+ * haszero trick, the result is exact for every byte, as the additions never carry beyond each byte. */
+static ALWAYS_INLINE uint64_t swar_lt(uint64_t x, unsigned char n)
+{
+    return ~(((x & ~SWAR_HIGH_BITS) + SWAR_ONES * (0x80 - n)) | x) & SWAR_HIGH_BITS;
+}
+
+static ALWAYS_INLINE uint64_t swar_eq(uint64_t x, unsigned char c)
+{
+    return swar_lt(x ^ (SWAR_ONES * c), 1);
+}
+
+static ALWAYS_INLINE uint64_t swar_in_range(uint64_t x, unsigned char lo, unsigned char hi)
+{
+    return swar_lt(x, hi + 1) & ~swar_lt(x, lo);
+}
+
+/* returns the offset of the first byte flagged in a mask built by the functions above */
+static ALWAYS_INLINE size_t swar_first(uint64_t mask)
+{
+#if defined(_MSC_VER) || (defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    return count_trailing_zeros(mask) / 8;
+#else
+    unsigned char bytes[8];
+    size_t i;
+    memcpy(bytes, &mask, 8);
+    for (i = 0; bytes[i] == 0; ++i)
+        ;
+    return i;
+#endif
+}
+
+/* Checks 8 bytes at once using 64-bit arithmetic. For FIND_NON_TOKEN, only alphanumerics and hyphen are classified as tchars;
+ * therefore the scan might stop at other tchars, which are rare. */
+static ALWAYS_INLINE const char *findchar_fast_swar(const char *buf, const char *buf_end, int kind, int *found)
+{
+    const char *start = buf;
+
+    *found = 0;
+    for (; likely(buf_end - buf >= 8); buf += 8) {
+        uint64_t x, low7, mask;
+        memcpy(&x, buf, 8);
+        low7 = x & ~SWAR_HIGH_BITS;
+        switch (kind) {
+        case FIND_CTL:
+            /* bytes below SP and DEL are detected at once using the lower 7 bits; HT is excluded only when something is found */
+            mask = (~(low7 + SWAR_ONES * (0x80 - 040)) | (low7 + SWAR_ONES)) & ~x & SWAR_HIGH_BITS;
+            if (unlikely(mask != 0))
+                mask &= ~swar_eq(x, '\011');
+            break;
+        case FIND_SPACE_OR_CTL:
+            mask = (~(low7 + SWAR_ONES * (0x80 - 041)) | (low7 + SWAR_ONES)) & ~x & SWAR_HIGH_BITS;
+            break;
+        default: /* FIND_NON_TOKEN */
+            mask = ~(swar_in_range(x | (SWAR_ONES * 0x20), 'a', 'z') | swar_in_range(x, '0', '9') | swar_eq(x, '-')) &
+                   SWAR_HIGH_BITS;
+            break;
+        }
+        if (mask != 0) {
+            *found = 1;
+            buf += swar_first(mask);
+            STATS_ADD(swar_bytes, buf - start);
+            return buf;
+        }
+    }
+    STATS_ADD(swar_bytes, buf - start);
+    STATS_ADD(tail_bytes, buf_end - buf);
+    return buf;
+}
+
+#ifdef HAVE_SSE42
+static const char ALIGNED(16) ranges_ctl[16] = "\0\010"    /* allow HT */
+                                               "\012\037"  /* allow SP and up to but not including DEL */
+                                               "\177\177"; /* allow chars w. MSB set */
+static const char ALIGNED(16) ranges_space_or_ctl[16] = "\000\040\177\177";
+/* pcmpestri can take no more than eight character ranges, which is not enough for covering the delimiters. Therefore tchars are
+ * classified using pshufb; a byte is a tchar iff the bit corresponding to its upper nibble (as mapped by `tchar_hi_nibble`) is set
+ * in the entry of `tchar_lo_nibble` indexed by its lower nibble. */
+static const unsigned char ALIGNED(16) tchar_lo_nibble[16] = {0xe8, 0xfc, 0xf8, 0xfc, 0xfc, 0xfc, 0xfc, 0xfc,
+                                                              0xf8, 0xf8, 0xf4, 0x54, 0xd0, 0x54, 0xf4, 0x70};
+static const unsigned char ALIGNED(16) tchar_hi_nibble[16] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+                                                              0,    0,    0,    0,    0,    0,    0,    0};
+
+TARGET("sse4.2")
+static ALWAYS_INLINE __m128i match_non_token_sse42(__m128i b)
+{
+    __m128i nibble_mask = _mm_set1_epi8(0xf), lo = _mm_and_si128(b, nibble_mask),
+            hi = _mm_and_si128(_mm_srli_epi16(b, 4), nibble_mask),
+            bits = _mm_and_si128(_mm_shuffle_epi8(_mm_load_si128((const __m128i *)tchar_lo_nibble), lo),
+                                 _mm_shuffle_epi8(_mm_load_si128((const __m128i *)tchar_hi_nibble), hi));
+    return _mm_cmpeq_epi8(bits, _mm_setzero_si128());
+}
+
+TARGET("sse4.2")
+static ALWAYS_INLINE const char *findchar_fast_sse42(const char *buf, const char *buf_end, int kind, int *found)
 {
+    const char *start = buf;
+
     *found = 0;
-#if __SSE4_2__
-    if (likely(buf_end - buf >= 16)) {
-        __m128i ranges16 = _mm_loadu_si128((const __m128i *)ranges);
+    if (kind == FIND_NON_TOKEN) {
+        for (; likely(buf_end - buf >= 16); buf += 16) {
+            unsigned mask = (unsigned)_mm_movemask_epi8(match_non_token_sse42(_mm_loadu_si128((const __m128i *)buf)));
+            if (mask != 0) {
+                *found = 1;
+                buf += count_trailing_zeros(mask);
+                STATS_ADD(simd_bytes, buf - start);
+                return buf;
+            }
+        }
+    } else if (likely(buf_end - buf >= 16)) {
+        __m128i ranges16 = _mm_loadu_si128((const __m128i *)(kind == FIND_CTL ? ranges_ctl : ranges_space_or_ctl));
+        int ranges_size = kind == FIND_CTL ? 6 : 4;
 
         size_t left = (buf_end - buf) & ~15;
         do {
@@ -121,54 +302,396 @@ static const char *findchar_fast(const char *buf, const char *buf_end, const cha
             buf += 16;
             left -= 16;
         } while (likely(left != 0));
+        if (*found) {
+            STATS_ADD(simd_bytes, buf - start);
+            return buf;
+        }
     }
-#else
-    /* suppress unused parameter warning */
-    (void)buf_end;
-    (void)ranges;
-    (void)ranges_size;
+    STATS_ADD(simd_bytes, buf - start);
+    return findchar_fast_swar(buf, buf_end, kind, found);
+}
 #endif
+
+#ifdef HAVE_AVX2
+TARGET("avx2")
+static ALWAYS_INLINE __m256i in_range_avx2(__m256i b, unsigned char lo, unsigned char hi)
+{
+    /* tested by subtracting the lower bound and doing an unsigned comparison against the width of the range */
+    __m256i off = _mm256_sub_epi8(b, _mm256_set1_epi8((char)lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(off, _mm256_set1_epi8((char)(hi - lo))), off);
+}
+
+TARGET("avx2")
+static ALWAYS_INLINE __m256i match_avx2(__m256i b, int kind)
+{
+    __m256i m;
+
+    switch (kind) {
+    case FIND_CTL:
+        m = _mm256_andnot_si256(_mm256_cmpeq_epi8(b, _mm256_set1_epi8('\011')), in_range_avx2(b, 0, 037));
+        return _mm256_or_si256(m, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('\177')));
+    case FIND_SPACE_OR_CTL:
+        return _mm256_or_si256(in_range_avx2(b, 0, 040), _mm256_cmpeq_epi8(b, _mm256_set1_epi8('\177')));
+    default: { /* FIND_NON_TOKEN */
+        __m256i nibble_mask = _mm256_set1_epi8(0xf), lo = _mm256_and_si256(b, nibble_mask),
+                hi = _mm256_and_si256(_mm256_srli_epi16(b, 4), nibble_mask),
+                bits = _mm256_and_si256(
+                    _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)tchar_lo_nibble)), lo),
+                    _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)tchar_hi_nibble)), hi));
+        return _mm256_cmpeq_epi8(bits, _mm256_setzero_si256());
+    }
+    }
+}
+
+/* checks 32 bytes at once using compare/movemask. A tail of 16 bytes or more is checked using the same code on the lower half of
+ * the register rather than by the SSE4.2 code, as pcmpestri is slow; the rest is handled by the SWAR code. */
+TARGET("avx2")
+static ALWAYS_INLINE const char *findchar_fast_avx2(const char *buf, const char *buf_end, int kind, int *found)
+{
+    const char *start = buf;
+    unsigned mask;
+
+    *found = 0;
+    while (likely(buf_end - buf >= 32)) {
+        mask = (unsigned)_mm256_movemask_epi8(match_avx2(_mm256_loadu_si256((const __m256i *)buf), kind));
+        if (unlikely(mask != 0))
+            goto Found;
+        buf += 32;
+    }
+    if (buf_end - buf >= 16) {
+        __m256i b = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)buf)); /* the upper half is undefined */
+        mask = (unsigned)_mm256_movemask_epi8(match_avx2(b, kind)) & 0xffff;
+        if (mask != 0)
+            goto Found;
+        buf += 16;
+    }
+    STATS_ADD(simd_bytes, buf - start);
+    return findchar_fast_swar(buf, buf_end, kind, found);
+
+Found:
+    *found = 1;
+    buf += count_trailing_zeros(mask);
+    STATS_ADD(simd_bytes, buf - start);
     return buf;
 }
+#endif
 
-static const char *get_token_to_eol(const char *buf, const char *buf_end, const char **token, size_t *token_len, int *ret)
+#ifdef HAVE_AVX512
+TARGET("avx512bw")
+static ALWAYS_INLINE __mmask64 in_range_avx512(__m512i b, unsigned char lo, unsigned char hi)
 {
-    const char *token_start = buf;
+    return _mm512_cmple_epu8_mask(_mm512_sub_epi8(b, _mm512_set1_epi8((char)lo)), _mm512_set1_epi8((char)(hi - lo)));
+}
 
-#ifdef __SSE4_2__
-    static const char ALIGNED(16) ranges1[16] = "\0\010"    /* allow HT */
-                                                "\012\037"  /* allow SP and up to but not including DEL */
-                                                "\177\177"; /* allow chars w. MSB set */
-    int found;
-    buf = findchar_fast(buf, buf_end, ranges1, 6, &found);
-    if (found)
-        goto FOUND_CTL;
+TARGET("avx512bw")
+static ALWAYS_INLINE __mmask64 match_avx512(__m512i b, int kind)
+{
+    switch (kind) {
+    case FIND_CTL:
+        return (in_range_avx512(b, 0, 037) & ~_mm512_cmpeq_epi8_mask(b, _mm512_set1_epi8('\011'))) |
+               _mm512_cmpeq_epi8_mask(b, _mm512_set1_epi8('\177'));
+    case FIND_SPACE_OR_CTL:
+        return in_range_avx512(b, 0, 040) | _mm512_cmpeq_epi8_mask(b, _mm512_set1_epi8('\177'));
+    default: { /* FIND_NON_TOKEN */
+        __m512i nibble_mask = _mm512_set1_epi8(0xf), lo = _mm512_and_si512(b, nibble_mask),
+                hi = _mm512_and_si512(_mm512_srli_epi16(b, 4), nibble_mask);
+        return _mm512_testn_epi8_mask(
+            _mm512_shuffle_epi8(_mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)tchar_lo_nibble)), lo),
+            _mm512_shuffle_epi8(_mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)tchar_hi_nibble)), hi));
+    }
+    }
+}
+
+/* same as the AVX2 variant, but checks 64 bytes at once using mask registers */
+TARGET("avx512bw")
+static ALWAYS_INLINE const char *findchar_fast_avx512(const char *buf, const char *buf_end, int kind, int *found)
+{
+    const char *start = buf;
+
+    while (likely(buf_end - buf >= 64)) {
+        __mmask64 mask = match_avx512(_mm512_loadu_si512((const void *)buf), kind);
+        if (unlikely(mask != 0)) {
+            *found = 1;
+            buf += count_trailing_zeros(mask);
+            STATS_ADD(simd_bytes, buf - start);
+            return buf;
+        }
+        buf += 64;
+    }
+    STATS_ADD(simd_bytes, buf - start);
+    return findchar_fast_avx2(buf, buf_end, kind, found);
+}
+#endif
+
+/* The following functions search for the end of the header block, that is either an LF that ends an empty line, or a CR not being
+ * followed by LF (which is an error). The two bytes preceding `buf` are looked at, and therefore must be readable. Like
+ * `findchar_fast_*`, they are inlined into the kernels so that the tail of a wider kernel is handled by the narrower code compiled
+ * for the same target, rather than by calling into a function using the legacy SSE encoding (which incurs the penalty of
+ * transitioning from AVX without VZEROUPPER). */
+
+static ALWAYS_INLINE const char *find_headers_end_fast_swar(const char *buf, const char *buf_end, int *found)
+{
+    const char *start = buf;
+
+    *found = 0;
+    for (; likely(buf_end - buf > 8); buf += 8) {
+        uint64_t cur, prev1, prev2, next1, mask;
+        memcpy(&cur, buf, 8);
+        if (likely((swar_eq(cur, '\012') | swar_eq(cur, '\015')) == 0))
+            continue;
+        memcpy(&prev1, buf - 1, 8);
+        memcpy(&prev2, buf - 2, 8);
+        memcpy(&next1, buf + 1, 8);
+        /* LF preceded by LF or CRLF, or CR not followed by LF */
+        mask = (swar_eq(cur, '\012') & (swar_eq(prev1, '\012') | (swar_eq(prev1, '\015') & swar_eq(prev2, '\012')))) |
+               (swar_eq(cur, '\015') & ~swar_eq(next1, '\012'));
+        if (mask != 0) {
+            *found = 1;
+            buf += swar_first(mask);
+            STATS_ADD(swar_bytes, buf - start);
+            return buf;
+        }
+    }
+    STATS_ADD(swar_bytes, buf - start);
+    STATS_ADD(tail_bytes, buf_end - buf);
+    return buf;
+}
+
+#ifdef HAVE_SSE42
+TARGET("sse4.2")
+static ALWAYS_INLINE const char *find_headers_end_fast_sse42(const char *buf, const char *buf_end, int *found)
+{
+    const char *start = buf;
+    __m128i cr = _mm_set1_epi8('\015'), lf = _mm_set1_epi8('\012');
+
+    *found = 0;
+    for (; likely(buf_end - buf > 16); buf += 16) {
+        __m128i cur = _mm_loadu_si128((const __m128i *)buf), prev1, prev2, next1, hit;
+        if (likely(_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(cur, lf), _mm_cmpeq_epi8(cur, cr))) == 0))
+            continue;
+        prev1 = _mm_loadu_si128((const __m128i *)(buf - 1));
+        prev2 = _mm_loadu_si128((const __m128i *)(buf - 2));
+        next1 = _mm_loadu_si128((const __m128i *)(buf + 1));
+        /* LF preceded by LF or CRLF, or CR not followed by LF */
+        hit = _mm_or_si128(_mm_cmpeq_epi8(prev1, lf), _mm_and_si128(_mm_cmpeq_epi8(prev1, cr), _mm_cmpeq_epi8(prev2, lf)));
+        hit = _mm_and_si128(_mm_cmpeq_epi8(cur, lf), hit);
+        hit = _mm_or_si128(hit, _mm_andnot_si128(_mm_cmpeq_epi8(next1, lf), _mm_cmpeq_epi8(cur, cr)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+        if (mask != 0) {
+            *found = 1;
+            buf += count_trailing_zeros(mask);
+            STATS_ADD(simd_bytes, buf - start);
+            return buf;
+        }
+    }
+    STATS_ADD(simd_bytes, buf - start);
+    return find_headers_end_fast_swar(buf, buf_end, found);
+}
+#endif
+
+#ifdef HAVE_AVX2
+TARGET("avx2")
+static ALWAYS_INLINE const char *find_headers_end_fast_avx2(const char *buf, const char *buf_end, int *found)
+{
+    const char *start = buf;
+    __m256i cr = _mm256_set1_epi8('\015'), lf = _mm256_set1_epi8('\012');
+
+    for (; likely(buf_end - buf > 32); buf += 32) {
+        __m256i cur = _mm256_loadu_si256((const __m256i *)buf), prev1, prev2, next1, hit;
+        if (likely(_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(cur, lf), _mm256_cmpeq_epi8(cur, cr))) == 0))
+            continue;
+        prev1 = _mm256_loadu_si256((const __m256i *)(buf - 1));
+        prev2 = _mm256_loadu_si256((const __m256i *)(buf - 2));
+        next1 = _mm256_loadu_si256((const __m256i *)(buf + 1));
+        /* LF preceded by LF or CRLF, or CR not followed by LF */
+        hit = _mm256_and_si256(_mm256_cmpeq_epi8(prev1, cr), _mm256_cmpeq_epi8(prev2, lf));
+        hit = _mm256_or_si256(_mm256_cmpeq_epi8(prev1, lf), hit);
+        hit = _mm256_and_si256(_mm256_cmpeq_epi8(cur, lf), hit);
+        hit = _mm256_or_si256(hit, _mm256_andnot_si256(_mm256_cmpeq_epi8(next1, lf), _mm256_cmpeq_epi8(cur, cr)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask != 0) {
+            *found = 1;
+            buf += count_trailing_zeros(mask);
+            STATS_ADD(simd_bytes, buf - start);
+            return buf;
+        }
+    }
+    STATS_ADD(simd_bytes, buf - start);
+    return find_headers_end_fast_sse42(buf, buf_end, found);
+}
+#endif
+
+#ifdef HAVE_AVX512
+TARGET("avx512bw")
+static ALWAYS_INLINE const char *find_headers_end_fast_avx512(const char *buf, const char *buf_end, int *found)
+{
+    const char *start = buf;
+    __m512i cr = _mm512_set1_epi8('\015'), lf = _mm512_set1_epi8('\012');
+
+    for (; likely(buf_end - buf > 64); buf += 64) {
+        __m512i cur = _mm512_loadu_si512((const void *)buf), prev1, prev2, next1;
+        __mmask64 cur_lf = _mm512_cmpeq_epi8_mask(cur, lf), cur_cr = _mm512_cmpeq_epi8_mask(cur, cr), mask;
+        if (likely((cur_lf | cur_cr) == 0))
+            continue;
+        prev1 = _mm512_loadu_si512((const void *)(buf - 1));
+        prev2 = _mm512_loadu_si512((const void *)(buf - 2));
+        next1 = _mm512_loadu_si512((const void *)(buf + 1));
+        /* LF preceded by LF or CRLF, or CR not followed by LF */
+        mask = _mm512_cmpeq_epi8_mask(prev1, lf) | (_mm512_cmpeq_epi8_mask(prev1, cr) & _mm512_cmpeq_epi8_mask(prev2, lf));
+        mask = (cur_lf & mask) | (cur_cr & ~_mm512_cmpeq_epi8_mask(next1, lf));
+        if (mask != 0) {
+            *found = 1;
+            buf += count_trailing_zeros(mask);
+            STATS_ADD(simd_bytes, buf - start);
+            return buf;
+        }
+    }
+    STATS_ADD(simd_bytes, buf - start);
+    return find_headers_end_fast_avx2(buf, buf_end, found);
+}
+#endif
+
+/* Each kernel scans the input from `buf` for the first character belonging to the given set, setting `*found` to 1 and returning
+ * the position if found. Otherwise, `*found` is set to 0, and the position up to which the input has been checked is returned; the
+ * caller is responsible for checking the rest byte by byte. The scalar kernel uses SWAR so that it can be used by builds without
+ * access to intrinsics. */
+struct scan_kernel {
+    int id;
+    /* CTLs other than HT, and DEL; used for finding the end of header values */
+    const char *(*find_ctl)(const char *buf, const char *buf_end, int *found);
+    /* CTLs, SP, and DEL; used for finding the end of request-target */
+    const char *(*find_space_or_ctl)(const char *buf, const char *buf_end, int *found);
+    /* characters that are not tchar (RFC 7230 3.2.6); the scalar kernel might also stop at tchars other than alnum and hyphen */
+    const char *(*find_non_token)(const char *buf, const char *buf_end, int *found);
+    /* end of the header block; see `find_headers_end_fast_swar` */
+    const char *(*find_headers_end)(const char *buf, const char *buf_end, int *found);
+};
+
+#define DEFINE_SCAN_KERNEL(isa, attr)                                                                                              \
+    attr static const char *find_ctl_##isa(const char *buf, const char *buf_end, int *found)                                       \
+    {                                                                                                                              \
+        return findchar_fast_##isa(buf, buf_end, FIND_CTL, found);                                                                 \
+    }                                                                                                                              \
+    attr static const char *find_space_or_ctl_##isa(const char *buf, const char *buf_end, int *found)                              \
+    {                                                                                                                              \
+        return findchar_fast_##isa(buf, buf_end, FIND_SPACE_OR_CTL, found);                                                        \
+    }                                                                                                                              \
+    attr static const char *find_non_token_##isa(const char *buf, const char *buf_end, int *found)                                 \
+    {                                                                                                                              \
+        return findchar_fast_##isa(buf, buf_end, FIND_NON_TOKEN, found);                                                           \
+    }                                                                                                                              \
+    attr static const char *find_headers_end_##isa(const char *buf, const char *buf_end, int *found)                               \
+    {                                                                                                                              \
+        return find_headers_end_fast_##isa(buf, buf_end, found);                                                                   \
+    }
+
+DEFINE_SCAN_KERNEL(swar, )
+#ifdef HAVE_SSE42
+DEFINE_SCAN_KERNEL(sse42, TARGET("sse4.2"))
+#endif
+#ifdef HAVE_AVX2
+DEFINE_SCAN_KERNEL(avx2, TARGET("avx2"))
+#endif
+#ifdef HAVE_AVX512
+DEFINE_SCAN_KERNEL(avx512, TARGET("avx512bw"))
+#endif
+
+#undef DEFINE_SCAN_KERNEL
+
+/* list of kernels built, in the order of preference. The order is based on the measurements rather than the width of the vectors;
+ * AVX-512 is slower than AVX2 for typical requests consisting of short tokens, while SSE4.2 is several times slower than both for
+ * long header values. */
+static const struct scan_kernel scan_kernels[] = {
+#ifdef HAVE_AVX2
+    {PHR_KERNEL_AVX2, find_ctl_avx2, find_space_or_ctl_avx2, find_non_token_avx2, find_headers_end_avx2},
+#endif
+#ifdef HAVE_AVX512
+    {PHR_KERNEL_AVX512, find_ctl_avx512, find_space_or_ctl_avx512, find_non_token_avx512, find_headers_end_avx512},
+#endif
+#ifdef HAVE_SSE42
+    {PHR_KERNEL_SSE42, find_ctl_sse42, find_space_or_ctl_sse42, find_non_token_sse42, find_headers_end_sse42},
+#endif
+    {PHR_KERNEL_SCALAR, find_ctl_swar, find_space_or_ctl_swar, find_non_token_swar, find_headers_end_swar}};
+
+#define NUM_SCAN_KERNELS (sizeof(scan_kernels) / sizeof(scan_kernels[0]))
+
+#ifdef RUNTIME_DISPATCH
+/* until `select_kernel` is called, the scalar kernel is used */
+static const struct scan_kernel *kernel = scan_kernels + NUM_SCAN_KERNELS - 1;
 #else
-    /* find non-printable char within the next 8 bytes, this is the hottest code; manually inlined */
-    while (likely(buf_end - buf >= 8)) {
-#define DOIT()                                                                                                                     \
-    do {                                                                                                                           \
-        if (unlikely(!IS_PRINTABLE_ASCII(*buf)))                                                                                   \
-            goto NonPrintable;                                                                                                     \
-        ++buf;                                                                                                                     \
-    } while (0)
-        DOIT();
-        DOIT();
-        DOIT();
-        DOIT();
-        DOIT();
-        DOIT();
-        DOIT();
-        DOIT();
-#undef DOIT
-        continue;
-    NonPrintable:
-        if ((likely((unsigned char)*buf < '\040') && likely(*buf != '\011')) || unlikely(*buf == '\177')) {
-            goto FOUND_CTL;
+/* all the kernels being built are supported by the CPU; use the first one */
+static const struct scan_kernel *kernel = scan_kernels;
+#endif
+
+static int kernel_is_supported(int id)
+{
+#ifdef RUNTIME_DISPATCH
+    __builtin_cpu_init();
+    switch (id) {
+    case PHR_KERNEL_AVX512:
+        return __builtin_cpu_supports("avx512bw");
+    case PHR_KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case PHR_KERNEL_SSE42:
+        return __builtin_cpu_supports("sse4.2");
+    default:
+        break;
+    }
+#else
+    (void)id;
+#endif
+    return 1;
+}
+
+int phr_get_kernel(void)
+{
+    return kernel->id;
+}
+
+int phr_set_kernel(int id)
+{
+    size_t i;
+
+    for (i = 0; i != NUM_SCAN_KERNELS; ++i) {
+        if ((id == PHR_KERNEL_AUTO || scan_kernels[i].id == id) && kernel_is_supported(scan_kernels[i].id)) {
+            kernel = scan_kernels + i;
+            return 0;
         }
-        ++buf;
     }
+    return -1;
+}
+
+#ifdef RUNTIME_DISPATCH
+__attribute__((constructor)) static void select_kernel(void)
+{
+    phr_set_kernel(PHR_KERNEL_AUTO);
+}
+#endif
+
+void phr_get_stats(struct phr_stats *dst)
+{
+#ifdef PHR_ENABLE_STATS
+    *dst = stats;
+#else
+    memset(dst, 0, sizeof(*dst));
 #endif
+}
+
+void phr_reset_stats(void)
+{
+#ifdef PHR_ENABLE_STATS
+    memset(&stats, 0, sizeof(stats));
+#endif
+}
+
+static const char *get_token_to_eol(const char *buf, const char *buf_end, const char **token, size_t *token_len, int *ret)
+{
+    const char *token_start = buf;
+    int found;
+
+    buf = kernel->find_ctl(buf, buf_end, &found);
+    if (found)
+        goto FOUND_CTL;
     for (;; ++buf) {
         CHECK_EOF();
         if (unlikely(!IS_PRINTABLE_ASCII(*buf))) {
@@ -182,7 +705,7 @@ FOUND_CTL:
         ++buf;
         EXPECT_CHAR('\012');
         *token_len = buf - 2 - token_start;
-    } else if (*buf == '\012') {
+    } else if (ALLOW_BARE_LF && *buf == '\012') {
         *token_len = buf - token_start;
         ++buf;
     } else {
@@ -194,32 +717,72 @@ FOUND_CTL:
     return buf;
 }
 
-static const char *is_complete(const char *buf, const char *buf_end, size_t last_len, int *ret)
+/* Checks if the byte at `p` terminates the header block, returning 1 if so, -1 if it is a CR not followed by LF, -2 if it is a CR
+ * at the end of input, or 0 otherwise. Line endings are looked for only after `start`. */
+static int check_headers_end(const char *start, const char *p, const char *buf_end)
+{
+    if (*p == '\012') {
+        if ((p - start >= 1 && p[-1] == '\012') || (p - start >= 2 && p[-1] == '\015' && p[-2] == '\012'))
+            return 1;
+    } else if (*p == '\015') {
+        if (p + 1 == buf_end)
+            return -2;
+        if (p[1] != '\012')
+            return -1;
+    }
+    return 0;
+}
+
+/* Returns if any of the LFs within [`p`, `end`) is not preceded by CR; the byte preceding `p` is looked at. Used when the policy
+ * requires CRLF, for checking the lines being skipped by `find_headers_end`, so that the boundary of the message is never drawn
+ * where the parser would reject the input. */
+static int has_bare_lf(const char *p, const char *end)
 {
-    int ret_cnt = 0;
-    buf = last_len < 3 ? buf : buf + last_len - 3;
+    for (; (p = memchr(p, '\012', end - p)) != NULL; ++p) {
+        if (p[-1] != '\015')
+            return 1;
+    }
+    return 0;
+}
 
-    while (1) {
-        CHECK_EOF();
-        if (*buf == '\015') {
-            ++buf;
-            CHECK_EOF();
-            EXPECT_CHAR('\012');
-            ++ret_cnt;
-        } else if (*buf == '\012') {
-            ++buf;
-            ++ret_cnt;
-        } else {
-            ++buf;
-            ret_cnt = 0;
-        }
-        if (ret_cnt == 2) {
-            return buf;
-        }
+/* Returns the position after the end of the header block, searching from `start`. Returns NULL with `*ret` set to -2 if not found,
+ * or to -1 if a CR not followed by LF is found. Bare LFs are accepted; see `has_bare_lf`. */
+static const char *find_headers_end(const char *start, const char *buf_end, int *ret)
+{
+    const char *buf;
+    int found, r;
+
+    /* the kernel looks back two bytes, therefore the first two bytes are checked here */
+    for (buf = start; buf != buf_end && buf - start < 2; ++buf) {
+        if ((r = check_headers_end(start, buf, buf_end)) != 0)
+            goto Found;
+    }
+    for (buf = kernel->find_headers_end(buf, buf_end, &found); buf != buf_end; ++buf) {
+        if ((r = check_headers_end(start, buf, buf_end)) != 0)
+            goto Found;
+    }
+    r = -2;
+
+Found:
+    if (r != 1) {
+        *ret = r;
+        return NULL;
     }
+    return buf + 1;
+}
+
+static const char *is_complete(const char *buf, const char *buf_end, size_t last_len, int *ret)
+{
+    const char *start = last_len < 3 ? buf : buf + last_len - 3;
 
-    *ret = -2;
-    return NULL;
+    STATS_ADD(rescanned_bytes, last_len - (start - buf));
+    if ((buf = find_headers_end(start, buf_end, ret)) == NULL) {
+        STATS_ADD(incomplete_rejections, 1);
+        return NULL;
+    }
+    /* the caller parses the message from the beginning */
+    STATS_ADD(rescanned_bytes, last_len);
+    return buf;
 }
 
 #define PARSE_INT(valp_, mul_)                                                                                                     \
@@ -242,34 +805,24 @@ static const char *is_complete(const char *buf, const char *buf_end, size_t last
     } while (0)
 
 /* returned pointer is always within [buf, buf_end), or null */
-static const char *parse_token(const char *buf, const char *buf_end, const char **token, size_t *token_len, char next_char,
-                               int *ret)
-{
-    /* We use pcmpestri to detect non-token characters. This instruction can take no more than eight character ranges (8*2*8=128
-     * bits that is the size of a SSE register). Due to this restriction, characters `|` and `~` are handled in the slow loop. */
-    static const char ALIGNED(16) ranges[] = "\x00 "  /* control chars and up to SP */
-                                             "\"\""   /* 0x22 */
-                                             "()"     /* 0x28,0x29 */
-                                             ",,"     /* 0x2c */
-                                             "//"     /* 0x2f */
-                                             ":@"     /* 0x3a-0x40 */
-                                             "[]"     /* 0x5b-0x5d */
-                                             "{\xff"; /* 0x7b-0xff */
+static ALWAYS_INLINE const char *parse_token(const char *buf, const char *buf_end, const char **token, size_t *token_len,
+                                             char next_char, int *ret)
+{
     const char *buf_start = buf;
     int found;
-    buf = findchar_fast(buf, buf_end, ranges, sizeof(ranges) - 1, &found);
-    if (!found) {
-        CHECK_EOF();
-    }
+    /* The kernel stops at the first non-token char, or at one of the rare tchars that it does not classify, or at the tail that it
+     * leaves unchecked; the loop validates that char and then lets the kernel resume. */
     while (1) {
+        buf = kernel->find_non_token(buf, buf_end, &found);
+        CHECK_EOF();
         if (*buf == next_char) {
             break;
         } else if (!token_char_map[(unsigned char)*buf]) {
             *ret = -1;
             return NULL;
         }
+        STATS_ADD(token_map_fallbacks, 1);
         ++buf;
-        CHECK_EOF();
     }
     *token = buf_start;
     *token_len = buf - buf_start;
@@ -295,114 +848,1123 @@ static const char *parse_http_version(const char *buf, const char *buf_end, int
     return buf;
 }
 
-static const char *parse_headers(const char *buf, const char *buf_end, struct phr_header *headers, size_t *num_headers,
-                                 size_t max_headers, int *ret)
+/* maps the hash of a header name to its ID; see `lookup_header` */
+static const unsigned char header_id_by_hash[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 48, 0, 0, 0, 42, 0, 0, 0, 0, 0, 47, 0, 0, 0, 21, 8, 0, 38, 0, 0, 0, 5, 3, 56,
+    0, 17, 0, 0, 0, 0, 0, 0, 0, 4, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 31, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 18, 0, 55, 16, 0, 0, 12, 0, 0, 0, 57, 0, 0, 0, 39, 0, 27, 41, 0, 0, 0, 0,
+    0, 0, 24, 0, 59, 0, 36, 0, 0, 0, 0, 0, 15, 22, 0, 0, 0, 28, 0, 0, 0, 0, 0, 0, 0, 50, 0, 0, 0, 0, 0, 0,
+    51, 0, 0, 0, 0, 0, 33, 0, 0, 0, 7, 23, 0, 0, 0, 0, 0, 0, 0, 0, 0, 13, 0, 0, 0, 0, 0, 0, 49, 0, 0, 0,
+    14, 0, 0, 0, 9, 0, 0, 0, 53, 0, 30, 0, 34, 0, 52, 0, 0, 0, 0, 0, 19, 0, 0, 11, 0, 0, 0, 26, 0, 0, 0, 0,
+    0, 10, 0, 54, 0, 0, 0, 37, 0, 35, 0, 0, 0, 0, 0, 0, 0, 0, 0, 29, 0, 0, 43, 0, 0, 0, 0, 0, 40, 0, 20, 46,
+    0, 0, 0, 60, 0, 0, 0, 25, 2, 0, 0, 0, 0, 0, 0, 0, 6, 0, 0, 0, 0, 0, 0, 0, 44, 0, 0, 0, 45, 58, 0, 32
+};
+
+/* lowercased names of the headers, indexed by ID */
+static const struct {
+    const char *name;
+    size_t len;
+} header_names[] = {{NULL, 0},
+    {"accept", 6}, {"accept-charset", 14}, {"accept-encoding", 15}, {"accept-language", 15}, {"accept-ranges", 13},
+    {"access-control-allow-origin", 27}, {"age", 3}, {"allow", 5}, {"authorization", 13}, {"cache-control", 13},
+    {"connection", 10}, {"content-disposition", 19}, {"content-encoding", 16}, {"content-language", 16}, {"content-length", 14},
+    {"content-location", 16}, {"content-range", 13}, {"content-type", 12}, {"cookie", 6}, {"date", 4}, {"etag", 4}, {"expect", 6},
+    {"expires", 7}, {"forwarded", 9}, {"from", 4}, {"host", 4}, {"http2-settings", 14}, {"if-match", 8}, {"if-modified-since", 17},
+    {"if-none-match", 13}, {"if-range", 8}, {"if-unmodified-since", 19}, {"keep-alive", 10}, {"last-modified", 13}, {"link", 4},
+    {"location", 8}, {"max-forwards", 12}, {"origin", 6}, {"proxy-authenticate", 18}, {"proxy-authorization", 19},
+    {"proxy-connection", 16}, {"range", 5}, {"referer", 7}, {"refresh", 7}, {"retry-after", 11}, {"server", 6}, {"set-cookie", 10},
+    {"strict-transport-security", 25}, {"te", 2}, {"trailer", 7}, {"transfer-encoding", 17}, {"upgrade", 7},
+    {"upgrade-insecure-requests", 25}, {"user-agent", 10}, {"vary", 4}, {"via", 3}, {"www-authenticate", 16},
+    {"x-forwarded-for", 15}, {"x-forwarded-proto", 17}, {"x-real-ip", 9}};
+
+/* compares a string with a lowercased one. Setting bit 5 lowercases the letters, and does not turn other characters that may
+ * appear in the header fields into the letters, digits or hyphens used by the lowercased strings being compared */
+static int equals_lowercase(const char *name, const char *lower, size_t len)
 {
-    for (;; ++*num_headers) {
-        CHECK_EOF();
-        if (*buf == '\015') {
-            ++buf;
-            EXPECT_CHAR('\012');
-            break;
-        } else if (*buf == '\012') {
-            ++buf;
+    for (; len >= 8; name += 8, lower += 8, len -= 8) {
+        uint64_t x, y;
+        memcpy(&x, name, 8);
+        memcpy(&y, lower, 8);
+        if ((x | SWAR_ONES * 0x20) != y)
+            return 0;
+    }
+    for (; len != 0; ++name, ++lower, --len) {
+        if ((*name | 0x20) != *lower)
+            return 0;
+    }
+    return 1;
+}
+
+/* looks up a header name consisting of token characters. The name is hashed using the first, the middle and the last characters
+ * and the length (a perfect hash for the names in `header_names`), then the only candidate is compared. */
+static ALWAYS_INLINE int lookup_header(const char *name, size_t len)
+{
+    uint32_t key = ((unsigned char)name[0] | (unsigned char)name[len - 1] << 8 | (uint32_t)len << 16 |
+                    (uint32_t)(unsigned char)name[len / 2] << 24) |
+                   0x20002020;
+    int id = header_id_by_hash[(uint32_t)(key * 0x4fbdd781) >> 24];
+    if (id != 0 && header_names[id].len == len && equals_lowercase(name, header_names[id].name, len))
+        return id;
+    return PHR_HEADER_UNKNOWN;
+}
+
+int phr_lookup_header(const char *name, size_t name_len)
+{
+    if (name_len == 0)
+        return PHR_HEADER_UNKNOWN;
+    return lookup_header(name, name_len);
+}
+
+/* parses the value of a header line, starting after the colon, or from the beginning of the line if it is a continuation line (i.e.
+ * `header->name` is NULL) */
+static ALWAYS_INLINE const char *parse_header_value(const char *buf, const char *buf_end, struct phr_header *header, int *ret)
+{
+    if (header->name != NULL) {
+        for (;; ++buf) {
+            CHECK_EOF();
+            if (!(*buf == ' ' || *buf == '\t')) {
+                break;
+            }
+        }
+    }
+    const char *value;
+    size_t value_len;
+    if ((buf = get_token_to_eol(buf, buf_end, &value, &value_len, ret)) == NULL) {
+        return NULL;
+    }
+    /* remove trailing SPs and HTABs */
+    const char *value_end = value + value_len;
+    for (; value_end != value; --value_end) {
+        const char c = *(value_end - 1);
+        if (!(c == ' ' || c == '\t')) {
             break;
         }
-        if (*num_headers == max_headers) {
-            *ret = -1;
+    }
+    header->value = value;
+    header->value_len = value_end - value;
+    return buf;
+}
+
+/* parses a header line, returning a pointer to the next line; `header->name` is set to NULL if the line is a continuation of the
+ * previous header. If `id` is non-NULL, the ID of the header name is stored */
+static ALWAYS_INLINE const char *parse_header_line(const char *buf, const char *buf_end, struct phr_header *header, int *id,
+                                                   int allow_continuation, int *ret)
+{
+    if (!(ALLOW_OBS_FOLD && allow_continuation && (*buf == ' ' || *buf == '\t'))) {
+        /* parsing name, but do not discard SP before colon, see
+         * http://www.mozilla.org/security/announce/2006/mfsa2006-33.html */
+        if ((buf = parse_token(buf, buf_end, &header->name, &header->name_len, ':', ret)) == NULL) {
+            return NULL;
+        }
+        if (header->name_len == 0) {
+            *ret = -1;
+            return NULL;
+        }
+        if (id != NULL)
+            *id = lookup_header(header->name, header->name_len);
+        ++buf;
+    } else {
+        header->name = NULL;
+        header->name_len = 0;
+        if (id != NULL)
+            *id = PHR_HEADER_UNKNOWN;
+    }
+    return parse_header_value(buf, buf_end, header, ret);
+}
+
+/* returns the next element of a comma-separated list with the surrounding OWS removed, or NULL if there are no more elements */
+static const char *next_list_element(const char **p, const char *end, size_t *element_len)
+{
+    const char *element;
+
+    while (*p != end && (**p == ',' || **p == ' ' || **p == '\t'))
+        ++*p;
+    if (*p == end)
+        return NULL;
+    for (element = *p; *p != end && **p != ','; ++*p)
+        ;
+    for (*element_len = *p - element; element[*element_len - 1] == ' ' || element[*element_len - 1] == '\t'; --*element_len)
+        ;
+    return element;
+}
+
+#define ELEMENT_IS(element, element_len, lit)                                                                                      \
+    ((element_len) == sizeof(lit) - 1 && equals_lowercase((element), (lit), sizeof(lit) - 1))
+
+/* updates `framing` using a header line, where `id` is the ID of the header field that the line belongs to. Returns -1 if the value
+ * is invalid or conflicts with the preceding ones */
+static int update_framing(struct phr_framing *framing, int id, const struct phr_header *header)
+{
+    const char *p = header->value, *end = header->value + header->value_len, *element;
+    size_t element_len;
+    int found = 0;
+
+    switch (id) {
+    case PHR_HEADER_CONTENT_LENGTH:
+        /* reject values being folded, empty, or consisting of different numbers (RFC 9110 section 8.6) */
+        if (header->name == NULL || header->value_len == 0)
+            return -1;
+        while ((element = next_list_element(&p, end, &element_len)) != NULL) {
+            size_t value = 0, i;
+            for (i = 0; i != element_len; ++i) {
+                if (!('0' <= element[i] && element[i] <= '9') || value > (SIZE_MAX - (element[i] - '0')) / 10)
+                    return -1;
+                value = value * 10 + (element[i] - '0');
+            }
+            if ((framing->flags & PHR_FRAMING_CONTENT_LENGTH) != 0 && framing->content_length != value)
+                return -1;
+            framing->content_length = value;
+            framing->flags |= PHR_FRAMING_CONTENT_LENGTH;
+            found = 1;
+        }
+        /* each field has to carry a number, even if the preceding fields did */
+        if (!found)
+            return -1;
+        break;
+    case PHR_HEADER_TRANSFER_ENCODING:
+        /* the message is chunked only if chunked is the final coding of the last field */
+        if (header->name == NULL || header->value_len == 0)
+            return -1;
+        framing->flags |= PHR_FRAMING_TRANSFER_ENCODING;
+        while ((element = next_list_element(&p, end, &element_len)) != NULL) {
+            if (ELEMENT_IS(element, element_len, "chunked")) {
+                framing->flags |= PHR_FRAMING_CHUNKED;
+            } else {
+                framing->flags &= ~PHR_FRAMING_CHUNKED;
+            }
+        }
+        break;
+    case PHR_HEADER_CONNECTION:
+        while ((element = next_list_element(&p, end, &element_len)) != NULL) {
+            if (ELEMENT_IS(element, element_len, "close")) {
+                framing->flags |= PHR_FRAMING_CONNECTION_CLOSE;
+            } else if (ELEMENT_IS(element, element_len, "keep-alive")) {
+                framing->flags |= PHR_FRAMING_CONNECTION_KEEP_ALIVE;
+            } else if (ELEMENT_IS(element, element_len, "upgrade")) {
+                framing->flags |= PHR_FRAMING_CONNECTION_UPGRADE;
+            }
+        }
+        break;
+    case PHR_HEADER_EXPECT:
+        if (header->name != NULL && ELEMENT_IS(header->value, header->value_len, "100-continue"))
+            framing->flags |= PHR_FRAMING_EXPECT_CONTINUE;
+        break;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+#undef ELEMENT_IS
+
+/* checks the framing after all the headers are parsed (RFC 9112 section 6.3) */
+static int finish_framing(struct phr_framing *framing, int is_request)
+{
+    if ((framing->flags & PHR_FRAMING_TRANSFER_ENCODING) != 0) {
+        /* a message having both is a typical attempt of request smuggling */
+        if ((framing->flags & PHR_FRAMING_CONTENT_LENGTH) != 0)
+            return -1;
+        /* the length of a request cannot be determined unless chunked is the final coding */
+        if (is_request && (framing->flags & PHR_FRAMING_CHUNKED) == 0)
+            return -1;
+    }
+    return 0;
+}
+
+static const char *parse_headers(const char *buf, const char *buf_end, struct phr_header *headers, int *header_ids,
+                                 struct phr_framing *framing, size_t *num_headers, size_t max_headers, int *ret)
+{
+    int framing_id = PHR_HEADER_UNKNOWN;
+
+    for (;; ++*num_headers) {
+        int id, *idp = header_ids != NULL ? header_ids + *num_headers : framing != NULL ? &id : NULL;
+        CHECK_EOF();
+        if (*buf == '\015') {
+            ++buf;
+            EXPECT_CHAR('\012');
+            break;
+        } else if (ALLOW_BARE_LF && *buf == '\012') {
+            ++buf;
+            break;
+        }
+        if (*num_headers == max_headers) {
+            *ret = -1;
+            return NULL;
+        }
+        if ((buf = parse_header_line(buf, buf_end, headers + *num_headers, idp, *num_headers != 0, ret)) == NULL) {
+            return NULL;
+        }
+        if (framing != NULL) {
+            /* continuation lines belong to the preceding header field */
+            if (headers[*num_headers].name != NULL)
+                framing_id = *idp;
+            if ((*ret = update_framing(framing, framing_id, headers + *num_headers)) != 0)
+                return NULL;
+        }
+    }
+    return buf;
+}
+
+/* same as `parse_headers`, but the progress is recorded in `state` so that parsing can be resumed from the line being incomplete */
+static const char *parse_headers_incremental(struct phr_parse_state *state, const char *buf_start, const char *buf_end,
+                                             struct phr_header *headers, size_t *num_headers, size_t max_headers, int *ret)
+{
+    const char *buf;
+    size_t i;
+
+    /* The headers found by the previous calls point into the buffer supplied at that time. If the buffer has moved, they are
+     * parsed again from the new one, as the old pointers might refer to memory that has been freed. */
+    if (state->_buf != (uintptr_t)buf_start) {
+        if (state->_num_headers > max_headers) {
+            *ret = -1;
             return NULL;
         }
-        if (!(*num_headers != 0 && (*buf == ' ' || *buf == '\t'))) {
-            /* parsing name, but do not discard SP before colon, see
-             * http://www.mozilla.org/security/announce/2006/mfsa2006-33.html */
-            if ((buf = parse_token(buf, buf_end, &headers[*num_headers].name, &headers[*num_headers].name_len, ':', ret)) == NULL) {
+        buf = buf_start + state->_headers_pos;
+        for (i = 0; i != state->_num_headers; ++i) {
+            buf = parse_header_line(buf, buf_end, headers + i, NULL, i != 0, ret);
+            assert(buf != NULL);
+        }
+        state->_buf = (uintptr_t)buf_start;
+    }
+
+    buf = buf_start + state->_pos;
+    for (*num_headers = state->_num_headers;; ++*num_headers) {
+        state->_pos = buf - buf_start;
+        state->_num_headers = *num_headers;
+        CHECK_EOF();
+        if (*buf == '\015') {
+            ++buf;
+            EXPECT_CHAR('\012');
+            break;
+        } else if (ALLOW_BARE_LF && *buf == '\012') {
+            ++buf;
+            break;
+        }
+        if (*num_headers == max_headers) {
+            *ret = -1;
+            return NULL;
+        }
+        if ((buf = parse_header_line(buf, buf_end, headers + *num_headers, NULL, *num_headers != 0, ret)) == NULL) {
+            return NULL;
+        }
+    }
+    return buf;
+}
+
+/* same as `parse_headers`, but stores the headers in the compact representation */
+static const char *parse_headers_compact(const char *buf_start, const char *buf, const char *buf_end,
+                                         struct phr_header_compact *headers, size_t *num_headers, size_t max_headers, int *ret)
+{
+    for (;; ++*num_headers) {
+        struct phr_header header;
+        CHECK_EOF();
+        if (*buf == '\015') {
+            ++buf;
+            EXPECT_CHAR('\012');
+            break;
+        } else if (ALLOW_BARE_LF && *buf == '\012') {
+            ++buf;
+            break;
+        }
+        if (*num_headers == max_headers) {
+            *ret = -1;
+            return NULL;
+        }
+        if ((buf = parse_header_line(buf, buf_end, &header, NULL, *num_headers != 0, ret)) == NULL) {
+            return NULL;
+        }
+        /* the value follows the name, therefore its offset is the largest */
+        if (header.name_len > UINT16_MAX || header.value_len > UINT16_MAX || (uint64_t)(header.value - buf_start) > UINT32_MAX) {
+            *ret = -1;
+            return NULL;
+        }
+        headers[*num_headers].name_off = header.name != NULL ? (uint32_t)(header.name - buf_start) : 0;
+        headers[*num_headers].value_off = (uint32_t)(header.value - buf_start);
+        headers[*num_headers].name_len = (uint16_t)header.name_len;
+        headers[*num_headers].value_len = (uint16_t)header.value_len;
+    }
+    return buf;
+}
+
+/* checks if the name is one of the wanted names, comparing them case-insensitively */
+static int is_wanted(const char *name, size_t name_len, const char *const *wanted, size_t num_wanted)
+{
+    size_t i, j;
+
+    for (i = 0; i != num_wanted; ++i) {
+        const char *w = wanted[i];
+        for (j = 0; j != name_len; ++j) {
+            unsigned char x = (unsigned char)name[j], y = (unsigned char)w[j];
+            if (y == '\0')
+                break;
+            if (x != y && ((x | 0x20) != (y | 0x20) || (unsigned)((x | 0x20) - 'a') > 'z' - 'a'))
+                break;
+        }
+        if (j == name_len && w[j] == '\0')
+            return 1;
+    }
+    return 0;
+}
+
+/* Same as `parse_headers`, but stores only the wanted headers. The names of all the headers are validated as `parse_header_line`
+ * does, so that a malformed name (e.g., one having whitespace before the colon) is rejected regardless of it being wanted; the
+ * values of the other headers are skipped by searching for LF using memchr, without being validated except for the line endings
+ * required by the policies. */
+static const char *parse_headers_selective(const char *buf, const char *buf_end, const char *const *wanted, size_t num_wanted,
+                                           struct phr_header *headers, size_t *num_headers, size_t max_headers, int *ret)
+{
+    const char *skip_from, *name = NULL;
+    size_t name_len = 0;
+    int is_first = 1, storing = 0;
+
+    for (;; is_first = 0) {
+        const char *eol;
+        CHECK_EOF();
+        if (*buf == '\015') {
+            ++buf;
+            EXPECT_CHAR('\012');
+            break;
+        } else if (ALLOW_BARE_LF && *buf == '\012') {
+            ++buf;
+            break;
+        }
+        if (*buf == ' ' || *buf == '\t') {
+            /* continuation lines belong to the preceding header */
+            if (is_first || !ALLOW_OBS_FOLD) {
+                *ret = -1;
+                return NULL;
+            }
+            name = NULL;
+            name_len = 0;
+            skip_from = buf;
+        } else {
+            const char *colon;
+            if ((colon = parse_token(buf, buf_end, &name, &name_len, ':', ret)) == NULL)
+                return NULL;
+            if (name_len == 0) {
+                *ret = -1;
                 return NULL;
             }
-            if (headers[*num_headers].name_len == 0) {
+            storing = is_wanted(name, name_len, wanted, num_wanted);
+            skip_from = colon + 1;
+        }
+        if (storing) {
+            if (*num_headers == max_headers) {
                 *ret = -1;
                 return NULL;
             }
-            ++buf;
-            for (;; ++buf) {
-                CHECK_EOF();
-                if (!(*buf == ' ' || *buf == '\t')) {
-                    break;
-                }
+            /* the name has been parsed above, therefore the value is parsed from the byte following the colon */
+            headers[*num_headers].name = name;
+            headers[*num_headers].name_len = name_len;
+            if ((buf = parse_header_value(skip_from, buf_end, headers + *num_headers, ret)) == NULL) {
+                return NULL;
             }
+            ++*num_headers;
         } else {
-            headers[*num_headers].name = NULL;
-            headers[*num_headers].name_len = 0;
+            if ((eol = memchr(skip_from, '\012', buf_end - skip_from)) == NULL) {
+                *ret = -2;
+                return NULL;
+            }
+            if (!ALLOW_BARE_LF && eol[-1] != '\015') {
+                *ret = -1;
+                return NULL;
+            }
+            buf = eol + 1;
+        }
+    }
+    return buf;
+}
+
+/* same as `parse_headers`, but reports the headers to the callback */
+static const char *parse_headers_cb(const char *buf, const char *buf_end, phr_header_cb cb, void *cb_data, int *ret)
+{
+    const char *header_end;
+    size_t num_headers;
+
+    for (num_headers = 0;; ++num_headers) {
+        struct phr_header header;
+        CHECK_EOF();
+        if (*buf == '\015') {
+            ++buf;
+            EXPECT_CHAR('\012');
+            break;
+        } else if (ALLOW_BARE_LF && *buf == '\012') {
+            ++buf;
+            break;
         }
-        const char *value;
-        size_t value_len;
-        if ((buf = get_token_to_eol(buf, buf_end, &value, &value_len, ret)) == NULL) {
+        if ((buf = parse_header_line(buf, buf_end, &header, NULL, num_headers != 0, ret)) == NULL) {
             return NULL;
         }
-        /* remove trailing SPs and HTABs */
-        const char *value_end = value + value_len;
-        for (; value_end != value; --value_end) {
-            const char c = *(value_end - 1);
-            if (!(c == ' ' || c == '\t')) {
-                break;
+        switch (cb(cb_data, &header)) {
+        case PHR_CB_CONTINUE:
+            break;
+        case PHR_CB_SKIP:
+            /* search from the LF that terminates the header line, as the empty line follows it */
+            if ((header_end = find_headers_end(buf - 1, buf_end, ret)) != NULL && !ALLOW_BARE_LF && has_bare_lf(buf, header_end)) {
+                *ret = -1;
+                return NULL;
             }
+            return header_end;
+        default:
+            *ret = -3;
+            return NULL;
         }
-        headers[*num_headers].value = value;
-        headers[*num_headers].value_len = value_end - value;
     }
     return buf;
 }
 
-static const char *parse_request(const char *buf, const char *buf_end, const char **method, size_t *method_len, const char **path,
-                                 size_t *path_len, int *minor_version, struct phr_header *headers, size_t *num_headers,
-                                 size_t max_headers, int *ret)
+static const char *parse_request_line(const char *buf, const char *buf_end, const char **method, size_t *method_len,
+                                      const char **path, size_t *path_len, int *minor_version, int *ret)
 {
     /* skip first empty line (some clients add CRLF after POST content) */
-    CHECK_EOF();
+    if (SKIP_LEADING_EMPTY_LINE) {
+        CHECK_EOF();
+        if (*buf == '\015') {
+            ++buf;
+            EXPECT_CHAR('\012');
+        } else if (ALLOW_BARE_LF && *buf == '\012') {
+            ++buf;
+        }
+    }
+
+    /* parse request line */
+    if ((buf = parse_token(buf, buf_end, method, method_len, ' ', ret)) == NULL) {
+        return NULL;
+    }
+    do {
+        ++buf;
+        CHECK_EOF();
+    } while (*buf == ' ');
+    ADVANCE_TOKEN(*path, *path_len);
+    do {
+        ++buf;
+        CHECK_EOF();
+    } while (*buf == ' ');
+    if (*method_len == 0 || *path_len == 0) {
+        *ret = -1;
+        return NULL;
+    }
+    if ((buf = parse_http_version(buf, buf_end, minor_version, ret)) == NULL) {
+        return NULL;
+    }
     if (*buf == '\015') {
         ++buf;
         EXPECT_CHAR('\012');
-    } else if (*buf == '\012') {
+    } else if (ALLOW_BARE_LF && *buf == '\012') {
         ++buf;
+    } else {
+        *ret = -1;
+        return NULL;
+    }
+
+    return buf;
+}
+
+static const char *parse_request(const char *buf, const char *buf_end, const char **method, size_t *method_len, const char **path,
+                                 size_t *path_len, int *minor_version, struct phr_header *headers, int *header_ids,
+                                 struct phr_framing *framing, size_t *num_headers, size_t max_headers, int *ret)
+{
+    if ((buf = parse_request_line(buf, buf_end, method, method_len, path, path_len, minor_version, ret)) == NULL) {
+        return NULL;
+    }
+    if ((buf = parse_headers(buf, buf_end, headers, header_ids, framing, num_headers, max_headers, ret)) == NULL) {
+        return NULL;
+    }
+    if (framing != NULL && (*ret = finish_framing(framing, 1)) != 0) {
+        return NULL;
+    }
+    return buf;
+}
+
+/* returns the result of a parse function, counting the -2 returns */
+static ALWAYS_INLINE int count_partial(int r)
+{
+    STATS_ADD(partial_returns, r == -2);
+    return r;
+}
+
+int phr_find_headers_end(const char *buf_start, size_t len, size_t last_len)
+{
+    const char *buf;
+    int r;
+
+    if ((buf = is_complete(buf_start, buf_start + len, last_len, &r)) == NULL)
+        return count_partial(r);
+    return (int)(buf - buf_start);
+}
+
+/* implements phr_parse_request and its variants */
+static int parse_request_message(const char *buf_start, size_t len, const char **method, size_t *method_len, const char **path,
+                                 size_t *path_len, int *minor_version, struct phr_header *headers, int *header_ids,
+                                 struct phr_framing *framing, size_t *num_headers, size_t last_len)
+{
+    const char *buf = buf_start, *buf_end = buf_start + len;
+    size_t max_headers = *num_headers;
+    int r;
+
+    *method = NULL;
+    *method_len = 0;
+    *path = NULL;
+    *path_len = 0;
+    *minor_version = -1;
+    *num_headers = 0;
+    if (framing != NULL) {
+        framing->content_length = 0;
+        framing->flags = 0;
+    }
+
+    /* if last_len != 0, check if the request is complete (a fast countermeasure
+       againt slowloris */
+    if (last_len != 0 && is_complete(buf, buf_end, last_len, &r) == NULL) {
+        return count_partial(r);
+    }
+
+    if ((buf = parse_request(buf, buf_end, method, method_len, path, path_len, minor_version, headers, header_ids, framing,
+                             num_headers, max_headers, &r)) == NULL) {
+        return count_partial(r);
+    }
+
+    return (int)(buf - buf_start);
+}
+
+int phr_parse_request(const char *buf_start, size_t len, const char **method, size_t *method_len, const char **path,
+                      size_t *path_len, int *minor_version, struct phr_header *headers, size_t *num_headers, size_t last_len)
+{
+    return parse_request_message(buf_start, len, method, method_len, path, path_len, minor_version, headers, NULL, NULL,
+                                 num_headers, last_len);
+}
+
+int phr_parse_request_with_ids(const char *buf_start, size_t len, const char **method, size_t *method_len, const char **path,
+                               size_t *path_len, int *minor_version, struct phr_header *headers, int *header_ids,
+                               size_t *num_headers, size_t last_len)
+{
+    return parse_request_message(buf_start, len, method, method_len, path, path_len, minor_version, headers, header_ids, NULL,
+                                 num_headers, last_len);
+}
+
+int phr_parse_request_framing(const char *buf_start, size_t len, const char **method, size_t *method_len, const char **path,
+                              size_t *path_len, int *minor_version, struct phr_header *headers, size_t *num_headers,
+                              struct phr_framing *framing, size_t last_len)
+{
+    return parse_request_message(buf_start, len, method, method_len, path, path_len, minor_version, headers, NULL, framing,
+                                 num_headers, last_len);
+}
+
+int phr_parse_request_compact(const char *buf_start, size_t len, const char **method, size_t *method_len, const char **path,
+                              size_t *path_len, int *minor_version, struct phr_header_compact *headers, size_t *num_headers,
+                              size_t last_len)
+{
+    const char *buf = buf_start, *buf_end = buf_start + len;
+    size_t max_headers = *num_headers;
+    int r;
+
+    *method = NULL;
+    *method_len = 0;
+    *path = NULL;
+    *path_len = 0;
+    *minor_version = -1;
+    *num_headers = 0;
+
+    /* if last_len != 0, check if the request is complete (a fast countermeasure
+       againt slowloris */
+    if (last_len != 0 && is_complete(buf, buf_end, last_len, &r) == NULL) {
+        return count_partial(r);
+    }
+
+    if ((buf = parse_request_line(buf, buf_end, method, method_len, path, path_len, minor_version, &r)) == NULL) {
+        return count_partial(r);
+    }
+    if ((buf = parse_headers_compact(buf_start, buf, buf_end, headers, num_headers, max_headers, &r)) == NULL) {
+        return count_partial(r);
+    }
+
+    return (int)(buf - buf_start);
+}
+
+/* returns if the bytes following the request belong to another protocol (i.e. the request is CONNECT or asks for an upgrade) */
+static int switches_protocols(const struct phr_request *req)
+{
+    return (req->framing.flags & PHR_FRAMING_CONNECTION_UPGRADE) != 0 ||
+           (req->method_len == 7 && memcmp(req->method, "CONNECT", 7) == 0);
+}
+
+int phr_parse_requests_batch(const char *buf_start, size_t len, struct phr_request *requests, size_t *num_requests,
+                             struct phr_header *headers, size_t *num_headers)
+{
+    const char *buf = buf_start, *buf_end = buf_start + len;
+    size_t max_requests = *num_requests, max_headers = *num_headers;
+    int r;
+
+    *num_requests = 0;
+    *num_headers = 0;
+
+    while (*num_requests != max_requests) {
+        struct phr_request *req = requests + *num_requests;
+        const char *next;
+        req->headers = headers + *num_headers;
+        req->num_headers = 0;
+        req->framing.content_length = 0;
+        req->framing.flags = 0;
+        if ((next = parse_request(buf, buf_end, &req->method, &req->method_len, &req->path, &req->path_len, &req->minor_version,
+                                  req->headers, NULL, &req->framing, &req->num_headers, max_headers - *num_headers, &r)) == NULL) {
+            /* errors after the first request are reported by the next call */
+            if (*num_requests == 0)
+                return count_partial(r);
+            break;
+        }
+        buf = next;
+        *num_headers += req->num_headers;
+        ++*num_requests;
+        /* the body or the data of the upgraded protocol have to be handled before the next request */
+        if (req->framing.content_length != 0 || (req->framing.flags & PHR_FRAMING_TRANSFER_ENCODING) != 0 ||
+            switches_protocols(req))
+            break;
+    }
+
+    return (int)(buf - buf_start);
+}
+
+static const char *parse_status_line(const char *buf, const char *buf_end, int *minor_version, int *status, const char **msg,
+                                     size_t *msg_len, int *ret)
+{
+    /* parse "HTTP/1.x" */
+    if ((buf = parse_http_version(buf, buf_end, minor_version, ret)) == NULL) {
+        return NULL;
+    }
+    /* skip space */
+    if (*buf != ' ') {
+        *ret = -1;
+        return NULL;
+    }
+    do {
+        ++buf;
+        CHECK_EOF();
+    } while (*buf == ' ');
+    /* parse status code, we want at least [:digit:][:digit:][:digit:]<other char> to try to parse */
+    if (buf_end - buf < 4) {
+        *ret = -2;
+        return NULL;
+    }
+    PARSE_INT_3(status);
+
+    /* get message including preceding space */
+    if ((buf = get_token_to_eol(buf, buf_end, msg, msg_len, ret)) == NULL) {
+        return NULL;
+    }
+    if (*msg_len == 0) {
+        /* ok */
+    } else if (**msg == ' ') {
+        /* Remove preceding space. Successful return from `get_token_to_eol` guarantees that we would hit something other than SP
+         * before running past the end of the given buffer. */
+        do {
+            ++*msg;
+            --*msg_len;
+        } while (**msg == ' ');
+    } else {
+        /* garbage found after status code */
+        *ret = -1;
+        return NULL;
+    }
+
+    return buf;
+}
+
+static const char *parse_response(const char *buf, const char *buf_end, int *minor_version, int *status, const char **msg,
+                                  size_t *msg_len, struct phr_header *headers, int *header_ids, struct phr_framing *framing,
+                                  size_t *num_headers, size_t max_headers, int *ret)
+{
+    if ((buf = parse_status_line(buf, buf_end, minor_version, status, msg, msg_len, ret)) == NULL) {
+        return NULL;
+    }
+    if ((buf = parse_headers(buf, buf_end, headers, header_ids, framing, num_headers, max_headers, ret)) == NULL) {
+        return NULL;
+    }
+    if (framing != NULL && (*ret = finish_framing(framing, 0)) != 0) {
+        return NULL;
+    }
+    return buf;
+}
+
+/* implements phr_parse_response and its variants */
+static int parse_response_message(const char *buf_start, size_t len, int *minor_version, int *status, const char **msg,
+                                  size_t *msg_len, struct phr_header *headers, int *header_ids, struct phr_framing *framing,
+                                  size_t *num_headers, size_t last_len)
+{
+    const char *buf = buf_start, *buf_end = buf + len;
+    size_t max_headers = *num_headers;
+    int r;
+
+    *minor_version = -1;
+    *status = 0;
+    *msg = NULL;
+    *msg_len = 0;
+    *num_headers = 0;
+    if (framing != NULL) {
+        framing->content_length = 0;
+        framing->flags = 0;
+    }
+
+    /* if last_len != 0, check if the response is complete (a fast countermeasure
+       against slowloris */
+    if (last_len != 0 && is_complete(buf, buf_end, last_len, &r) == NULL) {
+        return count_partial(r);
+    }
+
+    if ((buf = parse_response(buf, buf_end, minor_version, status, msg, msg_len, headers, header_ids, framing, num_headers,
+                              max_headers, &r)) == NULL) {
+        return count_partial(r);
+    }
+
+    return (int)(buf - buf_start);
+}
+
+int phr_parse_response(const char *buf_start, size_t len, int *minor_version, int *status, const char **msg, size_t *msg_len,
+                       struct phr_header *headers, size_t *num_headers, size_t last_len)
+{
+    return parse_response_message(buf_start, len, minor_version, status, msg, msg_len, headers, NULL, NULL, num_headers, last_len);
+}
+
+int phr_parse_response_with_ids(const char *buf_start, size_t len, int *minor_version, int *status, const char **msg,
+                                size_t *msg_len, struct phr_header *headers, int *header_ids, size_t *num_headers, size_t last_len)
+{
+    return parse_response_message(buf_start, len, minor_version, status, msg, msg_len, headers, header_ids, NULL, num_headers,
+                                  last_len);
+}
+
+int phr_parse_response_framing(const char *buf_start, size_t len, int *minor_version, int *status, const char **msg,
+                               size_t *msg_len, struct phr_header *headers, size_t *num_headers, struct phr_framing *framing,
+                               size_t last_len)
+{
+    return parse_response_message(buf_start, len, minor_version, status, msg, msg_len, headers, NULL, framing, num_headers,
+                                  last_len);
+}
+
+int phr_parse_response_compact(const char *buf_start, size_t len, int *minor_version, int *status, const char **msg,
+                               size_t *msg_len, struct phr_header_compact *headers, size_t *num_headers, size_t last_len)
+{
+    const char *buf = buf_start, *buf_end = buf + len;
+    size_t max_headers = *num_headers;
+    int r;
+
+    *minor_version = -1;
+    *status = 0;
+    *msg = NULL;
+    *msg_len = 0;
+    *num_headers = 0;
+
+    /* if last_len != 0, check if the response is complete (a fast countermeasure
+       against slowloris */
+    if (last_len != 0 && is_complete(buf, buf_end, last_len, &r) == NULL) {
+        return count_partial(r);
+    }
+
+    if ((buf = parse_status_line(buf, buf_end, minor_version, status, msg, msg_len, &r)) == NULL) {
+        return count_partial(r);
+    }
+    if ((buf = parse_headers_compact(buf_start, buf, buf_end, headers, num_headers, max_headers, &r)) == NULL) {
+        return count_partial(r);
+    }
+
+    return (int)(buf - buf_start);
+}
+
+int phr_parse_headers(const char *buf_start, size_t len, struct phr_header *headers, size_t *num_headers, size_t last_len)
+{
+    return phr_parse_headers_with_ids(buf_start, len, headers, NULL, num_headers, last_len);
+}
+
+int phr_parse_headers_with_ids(const char *buf_start, size_t len, struct phr_header *headers, int *header_ids, size_t *num_headers,
+                               size_t last_len)
+{
+    const char *buf = buf_start, *buf_end = buf + len;
+    size_t max_headers = *num_headers;
+    int r;
+
+    *num_headers = 0;
+
+    /* if last_len != 0, check if the response is complete (a fast countermeasure
+       against slowloris */
+    if (last_len != 0 && is_complete(buf, buf_end, last_len, &r) == NULL) {
+        return count_partial(r);
+    }
+
+    if ((buf = parse_headers(buf, buf_end, headers, header_ids, NULL, num_headers, max_headers, &r)) == NULL) {
+        return count_partial(r);
+    }
+
+    return (int)(buf - buf_start);
+}
+
+int phr_parse_headers_compact(const char *buf_start, size_t len, struct phr_header_compact *headers, size_t *num_headers,
+                              size_t last_len)
+{
+    const char *buf = buf_start, *buf_end = buf + len;
+    size_t max_headers = *num_headers;
+    int r;
+
+    *num_headers = 0;
+
+    /* if last_len != 0, check if the response is complete (a fast countermeasure
+       against slowloris */
+    if (last_len != 0 && is_complete(buf, buf_end, last_len, &r) == NULL) {
+        return count_partial(r);
+    }
+
+    if ((buf = parse_headers_compact(buf, buf, buf_end, headers, num_headers, max_headers, &r)) == NULL) {
+        return count_partial(r);
+    }
+
+    return (int)(buf - buf_start);
+}
+
+int phr_parse_request_incremental(struct phr_parse_state *state, const char *buf_start, size_t len, const char **method,
+                                  size_t *method_len, const char **path, size_t *path_len, int *minor_version,
+                                  struct phr_header *headers, size_t *num_headers)
+{
+    const char *buf = buf_start, *buf_end = buf_start + len;
+    size_t max_headers = *num_headers;
+    int r;
+
+    *method = NULL;
+    *method_len = 0;
+    *path = NULL;
+    *path_len = 0;
+    *minor_version = -1;
+    *num_headers = 0;
+
+    /* the request line is parsed every time, so that the values point into the buffer being supplied */
+    if ((buf = parse_request_line(buf, buf_end, method, method_len, path, path_len, minor_version, &r)) == NULL) {
+        return count_partial(r);
+    }
+    if (state->_pos == 0)
+        state->_pos = state->_headers_pos = buf - buf_start;
+
+    if ((buf = parse_headers_incremental(state, buf_start, buf_end, headers, num_headers, max_headers, &r)) == NULL) {
+        return count_partial(r);
+    }
+
+    return (int)(buf - buf_start);
+}
+
+int phr_parse_response_incremental(struct phr_parse_state *state, const char *buf_start, size_t len, int *minor_version,
+                                   int *status, const char **msg, size_t *msg_len, struct phr_header *headers, size_t *num_headers)
+{
+    const char *buf = buf_start, *buf_end = buf_start + len;
+    size_t max_headers = *num_headers;
+    int r;
+
+    *minor_version = -1;
+    *status = 0;
+    *msg = NULL;
+    *msg_len = 0;
+    *num_headers = 0;
+
+    /* the status line is parsed every time, so that the message points into the buffer being supplied */
+    if ((buf = parse_status_line(buf, buf_end, minor_version, status, msg, msg_len, &r)) == NULL) {
+        return count_partial(r);
+    }
+    if (state->_pos == 0)
+        state->_pos = state->_headers_pos = buf - buf_start;
+
+    if ((buf = parse_headers_incremental(state, buf_start, buf_end, headers, num_headers, max_headers, &r)) == NULL) {
+        return count_partial(r);
+    }
+
+    return (int)(buf - buf_start);
+}
+
+int phr_parse_headers_incremental(struct phr_parse_state *state, const char *buf_start, size_t len, struct phr_header *headers,
+                                  size_t *num_headers)
+{
+    const char *buf;
+    size_t max_headers = *num_headers;
+    int r;
+
+    if ((buf = parse_headers_incremental(state, buf_start, buf_start + len, headers, num_headers, max_headers, &r)) == NULL) {
+        return count_partial(r);
+    }
+
+    return (int)(buf - buf_start);
+}
+
+/* locates the end of the header block that follows the request line or the status line ending right before `buf` */
+/* `end` is the end of the header block if it has already been located by `is_complete`, or NULL */
+static const char *locate_lazy_headers(const char *buf, const char *buf_end, const char *end, struct phr_lazy_headers *headers,
+                                       int *ret)
+{
+    /* search from the LF that terminates the request line or the status line, as the header block might be empty */
+    if (end == NULL && (end = find_headers_end(buf - 1, buf_end, ret)) == NULL)
+        return NULL;
+    if (!ALLOW_BARE_LF && has_bare_lf(buf, end)) {
+        *ret = -1;
+        return NULL;
+    }
+    headers->_start = buf;
+    headers->_end = end;
+    return end;
+}
+
+int phr_parse_request_lazy(const char *buf_start, size_t len, const char **method, size_t *method_len, const char **path,
+                           size_t *path_len, int *minor_version, struct phr_lazy_headers *headers, size_t last_len)
+{
+    const char *buf = buf_start, *buf_end = buf_start + len, *end = NULL;
+    int r;
+
+    *method = NULL;
+    *method_len = 0;
+    *path = NULL;
+    *path_len = 0;
+    *minor_version = -1;
+    headers->_start = NULL;
+    headers->_end = NULL;
+
+    /* the end of the header block found by the check is reused, so that the input is scanned only once */
+    if (last_len != 0 && (end = is_complete(buf, buf_end, last_len, &r)) == NULL) {
+        return count_partial(r);
+    }
+
+    if ((buf = parse_request_line(buf, buf_end, method, method_len, path, path_len, minor_version, &r)) == NULL) {
+        return count_partial(r);
+    }
+    if ((buf = locate_lazy_headers(buf, buf_end, end, headers, &r)) == NULL) {
+        return count_partial(r);
+    }
+
+    return (int)(buf - buf_start);
+}
+
+int phr_parse_response_lazy(const char *buf_start, size_t len, int *minor_version, int *status, const char **msg, size_t *msg_len,
+                            struct phr_lazy_headers *headers, size_t last_len)
+{
+    const char *buf = buf_start, *buf_end = buf_start + len, *end = NULL;
+    int r;
+
+    *minor_version = -1;
+    *status = 0;
+    *msg = NULL;
+    *msg_len = 0;
+    headers->_start = NULL;
+    headers->_end = NULL;
+
+    if (last_len != 0 && (end = is_complete(buf, buf_end, last_len, &r)) == NULL) {
+        return count_partial(r);
+    }
+
+    if ((buf = parse_status_line(buf, buf_end, minor_version, status, msg, msg_len, &r)) == NULL) {
+        return count_partial(r);
+    }
+    if ((buf = locate_lazy_headers(buf, buf_end, end, headers, &r)) == NULL) {
+        return count_partial(r);
+    }
+
+    return (int)(buf - buf_start);
+}
+
+int phr_lazy_next_header(const struct phr_lazy_headers *headers, size_t *cursor, struct phr_header *header)
+{
+    const char *buf = headers->_start + *cursor;
+    int r;
+
+    /* the header block is known to be complete, hence the parser never asks for more data */
+    if (*buf == '\015' || (ALLOW_BARE_LF && *buf == '\012'))
+        return 0;
+    if ((buf = parse_header_line(buf, headers->_end, header, NULL, *cursor != 0, &r)) == NULL)
+        return -1;
+    *cursor = buf - headers->_start;
+    return 1;
+}
+
+int phr_lazy_split_headers(const struct phr_lazy_headers *lazy, struct phr_header *headers, size_t *num_headers)
+{
+    size_t max_headers = *num_headers;
+    int r;
+
+    *num_headers = 0;
+    return parse_headers(lazy->_start, lazy->_end, headers, NULL, NULL, num_headers, max_headers, &r) != NULL ? 0 : -1;
+}
+
+int phr_parse_request_selective(const char *buf_start, size_t len, const char **method, size_t *method_len, const char **path,
+                                size_t *path_len, int *minor_version, const char *const *wanted, size_t num_wanted,
+                                struct phr_header *headers, size_t *num_headers, size_t last_len)
+{
+    const char *buf = buf_start, *buf_end = buf_start + len;
+    size_t max_headers = *num_headers;
+    int r;
+
+    *method = NULL;
+    *method_len = 0;
+    *path = NULL;
+    *path_len = 0;
+    *minor_version = -1;
+    *num_headers = 0;
+
+    if (last_len != 0 && is_complete(buf, buf_end, last_len, &r) == NULL) {
+        return count_partial(r);
+    }
+
+    if ((buf = parse_request_line(buf, buf_end, method, method_len, path, path_len, minor_version, &r)) == NULL) {
+        return count_partial(r);
+    }
+    if ((buf = parse_headers_selective(buf, buf_end, wanted, num_wanted, headers, num_headers, max_headers, &r)) == NULL) {
+        return count_partial(r);
+    }
+
+    return (int)(buf - buf_start);
+}
+
+int phr_parse_response_selective(const char *buf_start, size_t len, int *minor_version, int *status, const char **msg,
+                                 size_t *msg_len, const char *const *wanted, size_t num_wanted, struct phr_header *headers,
+                                 size_t *num_headers, size_t last_len)
+{
+    const char *buf = buf_start, *buf_end = buf_start + len;
+    size_t max_headers = *num_headers;
+    int r;
+
+    *minor_version = -1;
+    *status = 0;
+    *msg = NULL;
+    *msg_len = 0;
+    *num_headers = 0;
+
+    if (last_len != 0 && is_complete(buf, buf_end, last_len, &r) == NULL) {
+        return count_partial(r);
     }
 
-    /* parse request line */
-    if ((buf = parse_token(buf, buf_end, method, method_len, ' ', ret)) == NULL) {
-        return NULL;
+    if ((buf = parse_status_line(buf, buf_end, minor_version, status, msg, msg_len, &r)) == NULL) {
+        return count_partial(r);
     }
-    do {
-        ++buf;
-        CHECK_EOF();
-    } while (*buf == ' ');
-    ADVANCE_TOKEN(*path, *path_len);
-    do {
-        ++buf;
-        CHECK_EOF();
-    } while (*buf == ' ');
-    if (*method_len == 0 || *path_len == 0) {
-        *ret = -1;
-        return NULL;
+    if ((buf = parse_headers_selective(buf, buf_end, wanted, num_wanted, headers, num_headers, max_headers, &r)) == NULL) {
+        return count_partial(r);
     }
-    if ((buf = parse_http_version(buf, buf_end, minor_version, ret)) == NULL) {
-        return NULL;
+
+    return (int)(buf - buf_start);
+}
+
+int phr_parse_headers_selective(const char *buf_start, size_t len, const char *const *wanted, size_t num_wanted,
+                                struct phr_header *headers, size_t *num_headers, size_t last_len)
+{
+    const char *buf = buf_start, *buf_end = buf_start + len;
+    size_t max_headers = *num_headers;
+    int r;
+
+    *num_headers = 0;
+
+    if (last_len != 0 && is_complete(buf, buf_end, last_len, &r) == NULL) {
+        return count_partial(r);
     }
-    if (*buf == '\015') {
-        ++buf;
-        EXPECT_CHAR('\012');
-    } else if (*buf == '\012') {
-        ++buf;
-    } else {
-        *ret = -1;
-        return NULL;
+
+    if ((buf = parse_headers_selective(buf, buf_end, wanted, num_wanted, headers, num_headers, max_headers, &r)) == NULL) {
+        return count_partial(r);
     }
 
-    return parse_headers(buf, buf_end, headers, num_headers, max_headers, ret);
+    return (int)(buf - buf_start);
 }
 
-int phr_parse_request(const char *buf_start, size_t len, const char **method, size_t *method_len, const char **path,
-                      size_t *path_len, int *minor_version, struct phr_header *headers, size_t *num_headers, size_t last_len)
+int phr_parse_request_cb(const char *buf_start, size_t len, const char **method, size_t *method_len, const char **path,
+                         size_t *path_len, int *minor_version, phr_header_cb cb, void *cb_data, size_t last_len)
 {
     const char *buf = buf_start, *buf_end = buf_start + len;
-    size_t max_headers = *num_headers;
     int r;
 
     *method = NULL;
@@ -410,71 +1972,182 @@ int phr_parse_request(const char *buf_start, size_t len, const char **method, si
     *path = NULL;
     *path_len = 0;
     *minor_version = -1;
-    *num_headers = 0;
 
-    /* if last_len != 0, check if the request is complete (a fast countermeasure
-       againt slowloris */
     if (last_len != 0 && is_complete(buf, buf_end, last_len, &r) == NULL) {
-        return r;
+        return count_partial(r);
     }
 
-    if ((buf = parse_request(buf, buf_end, method, method_len, path, path_len, minor_version, headers, num_headers, max_headers,
-                             &r)) == NULL) {
-        return r;
+    if ((buf = parse_request_line(buf, buf_end, method, method_len, path, path_len, minor_version, &r)) == NULL) {
+        return count_partial(r);
+    }
+    if ((buf = parse_headers_cb(buf, buf_end, cb, cb_data, &r)) == NULL) {
+        return count_partial(r);
     }
 
     return (int)(buf - buf_start);
 }
 
-static const char *parse_response(const char *buf, const char *buf_end, int *minor_version, int *status, const char **msg,
-                                  size_t *msg_len, struct phr_header *headers, size_t *num_headers, size_t max_headers, int *ret)
+int phr_parse_response_cb(const char *buf_start, size_t len, int *minor_version, int *status, const char **msg, size_t *msg_len,
+                          phr_header_cb cb, void *cb_data, size_t last_len)
 {
-    /* parse "HTTP/1.x" */
-    if ((buf = parse_http_version(buf, buf_end, minor_version, ret)) == NULL) {
-        return NULL;
+    const char *buf = buf_start, *buf_end = buf_start + len;
+    int r;
+
+    *minor_version = -1;
+    *status = 0;
+    *msg = NULL;
+    *msg_len = 0;
+
+    if (last_len != 0 && is_complete(buf, buf_end, last_len, &r) == NULL) {
+        return count_partial(r);
     }
-    /* skip space */
-    if (*buf != ' ') {
-        *ret = -1;
-        return NULL;
+
+    if ((buf = parse_status_line(buf, buf_end, minor_version, status, msg, msg_len, &r)) == NULL) {
+        return count_partial(r);
     }
-    do {
-        ++buf;
-        CHECK_EOF();
-    } while (*buf == ' ');
-    /* parse status code, we want at least [:digit:][:digit:][:digit:]<other char> to try to parse */
-    if (buf_end - buf < 4) {
-        *ret = -2;
-        return NULL;
+    if ((buf = parse_headers_cb(buf, buf_end, cb, cb_data, &r)) == NULL) {
+        return count_partial(r);
     }
-    PARSE_INT_3(status);
 
-    /* get message including preceding space */
-    if ((buf = get_token_to_eol(buf, buf_end, msg, msg_len, ret)) == NULL) {
-        return NULL;
+    return (int)(buf - buf_start);
+}
+
+int phr_parse_headers_cb(const char *buf_start, size_t len, phr_header_cb cb, void *cb_data, size_t last_len)
+{
+    const char *buf = buf_start, *buf_end = buf_start + len;
+    int r;
+
+    if (last_len != 0 && is_complete(buf, buf_end, last_len, &r) == NULL) {
+        return count_partial(r);
     }
-    if (*msg_len == 0) {
-        /* ok */
-    } else if (**msg == ' ') {
-        /* Remove preceding space. Successful return from `get_token_to_eol` guarantees that we would hit something other than SP
-         * before running past the end of the given buffer. */
-        do {
-            ++*msg;
-            --*msg_len;
-        } while (**msg == ' ');
-    } else {
-        /* garbage found after status code */
-        *ret = -1;
-        return NULL;
+
+    if ((buf = parse_headers_cb(buf, buf_end, cb, cb_data, &r)) == NULL) {
+        return count_partial(r);
     }
 
-    return parse_headers(buf, buf_end, headers, num_headers, max_headers, ret);
+    return (int)(buf - buf_start);
 }
 
-int phr_parse_response(const char *buf_start, size_t len, int *minor_version, int *status, const char **msg, size_t *msg_len,
-                       struct phr_header *headers, size_t *num_headers, size_t last_len)
+/* reads the input given as an array of segments line by line */
+struct iovec_reader {
+    const struct phr_iovec *iov;
+    size_t iovcnt;
+    size_t index;    /* index of the current segment */
+    size_t off;      /* offset within the current segment */
+    size_t consumed; /* number of bytes being consumed */
+    char *scratch;
+    char *scratch_end;
+};
+
+/* Returns the next line (including the line terminator). A line residing within a segment is returned as is. A line that
+ * straddles the segments is copied into the scratch buffer; -1 is returned if the buffer is too small. */
+static int iovec_next_line(struct iovec_reader *reader, const char **line, const char **line_end)
 {
-    const char *buf = buf_start, *buf_end = buf + len;
+    const char *seg, *lf;
+    size_t seg_len, index, off, copy_len;
+    char *dst;
+
+    /* skip empty segments */
+    while (reader->index != reader->iovcnt && reader->off == reader->iov[reader->index].len) {
+        ++reader->index;
+        reader->off = 0;
+    }
+    if (reader->index == reader->iovcnt)
+        return -2;
+
+    /* fast path; the line ends within the current segment */
+    seg = reader->iov[reader->index].base;
+    seg_len = reader->iov[reader->index].len;
+    if ((lf = memchr(seg + reader->off, '\012', seg_len - reader->off)) != NULL) {
+        *line = seg + reader->off;
+        *line_end = lf + 1;
+        reader->consumed += *line_end - *line;
+        reader->off = *line_end - seg;
+        return 0;
+    }
+
+    /* slow path; find the end of the line in the following segments, then copy the line */
+    for (index = reader->index + 1;; ++index) {
+        if (index == reader->iovcnt)
+            return -2;
+        if ((lf = memchr(reader->iov[index].base, '\012', reader->iov[index].len)) != NULL)
+            break;
+    }
+    dst = reader->scratch;
+    for (off = reader->off; reader->index != index; ++reader->index, off = 0) {
+        copy_len = reader->iov[reader->index].len - off;
+        if ((size_t)(reader->scratch_end - dst) < copy_len)
+            return -1;
+        memcpy(dst, reader->iov[reader->index].base + off, copy_len);
+        dst += copy_len;
+    }
+    copy_len = lf + 1 - reader->iov[index].base;
+    if ((size_t)(reader->scratch_end - dst) < copy_len)
+        return -1;
+    memcpy(dst, reader->iov[index].base, copy_len);
+    dst += copy_len;
+    reader->off = copy_len;
+    *line = reader->scratch;
+    *line_end = dst;
+    reader->consumed += dst - reader->scratch;
+    reader->scratch = dst;
+    return 0;
+}
+
+static int parse_headers_iov(struct iovec_reader *reader, struct phr_header *headers, size_t *num_headers, size_t max_headers)
+{
+    const char *line, *line_end;
+    int r;
+
+    for (;; ++*num_headers) {
+        if ((r = iovec_next_line(reader, &line, &line_end)) != 0)
+            return r;
+        if (*line == '\015' || (ALLOW_BARE_LF && *line == '\012'))
+            return line_end - line == (*line == '\015' ? 2 : 1) ? 0 : -1;
+        if (*num_headers == max_headers)
+            return -1;
+        /* the line is complete, hence the parser never asks for more data */
+        if (parse_header_line(line, line_end, headers + *num_headers, NULL, *num_headers != 0, &r) == NULL)
+            return -1;
+    }
+}
+
+int phr_parse_request_iov(const struct phr_iovec *iov, size_t iovcnt, char *scratch, size_t scratch_len, const char **method,
+                          size_t *method_len, const char **path, size_t *path_len, int *minor_version, struct phr_header *headers,
+                          size_t *num_headers)
+{
+    struct iovec_reader reader = {iov, iovcnt, 0, 0, 0, scratch, scratch + scratch_len};
+    const char *line, *line_end;
+    size_t max_headers = *num_headers;
+    int r;
+
+    *method = NULL;
+    *method_len = 0;
+    *path = NULL;
+    *path_len = 0;
+    *minor_version = -1;
+    *num_headers = 0;
+
+    /* skip first empty line (some clients add CRLF after POST content) */
+    if ((r = iovec_next_line(&reader, &line, &line_end)) != 0)
+        return count_partial(r);
+    if (SKIP_LEADING_EMPTY_LINE && line_end - line == (*line == '\015' ? 2 : ALLOW_BARE_LF) &&
+        (r = iovec_next_line(&reader, &line, &line_end)) != 0)
+        return count_partial(r);
+    if (parse_request_line(line, line_end, method, method_len, path, path_len, minor_version, &r) == NULL)
+        return -1;
+
+    if ((r = parse_headers_iov(&reader, headers, num_headers, max_headers)) != 0)
+        return count_partial(r);
+
+    return (int)reader.consumed;
+}
+
+int phr_parse_response_iov(const struct phr_iovec *iov, size_t iovcnt, char *scratch, size_t scratch_len, int *minor_version,
+                           int *status, const char **msg, size_t *msg_len, struct phr_header *headers, size_t *num_headers)
+{
+    struct iovec_reader reader = {iov, iovcnt, 0, 0, 0, scratch, scratch + scratch_len};
+    const char *line, *line_end;
     size_t max_headers = *num_headers;
     int r;
 
@@ -484,38 +2157,30 @@ int phr_parse_response(const char *buf_start, size_t len, int *minor_version, in
     *msg_len = 0;
     *num_headers = 0;
 
-    /* if last_len != 0, check if the response is complete (a fast countermeasure
-       against slowloris */
-    if (last_len != 0 && is_complete(buf, buf_end, last_len, &r) == NULL) {
-        return r;
-    }
+    if ((r = iovec_next_line(&reader, &line, &line_end)) != 0)
+        return count_partial(r);
+    if (parse_status_line(line, line_end, minor_version, status, msg, msg_len, &r) == NULL)
+        return -1;
 
-    if ((buf = parse_response(buf, buf_end, minor_version, status, msg, msg_len, headers, num_headers, max_headers, &r)) == NULL) {
-        return r;
-    }
+    if ((r = parse_headers_iov(&reader, headers, num_headers, max_headers)) != 0)
+        return count_partial(r);
 
-    return (int)(buf - buf_start);
+    return (int)reader.consumed;
 }
 
-int phr_parse_headers(const char *buf_start, size_t len, struct phr_header *headers, size_t *num_headers, size_t last_len)
+int phr_parse_headers_iov(const struct phr_iovec *iov, size_t iovcnt, char *scratch, size_t scratch_len, struct phr_header *headers,
+                          size_t *num_headers)
 {
-    const char *buf = buf_start, *buf_end = buf + len;
+    struct iovec_reader reader = {iov, iovcnt, 0, 0, 0, scratch, scratch + scratch_len};
     size_t max_headers = *num_headers;
     int r;
 
     *num_headers = 0;
 
-    /* if last_len != 0, check if the response is complete (a fast countermeasure
-       against slowloris */
-    if (last_len != 0 && is_complete(buf, buf_end, last_len, &r) == NULL) {
-        return r;
-    }
-
-    if ((buf = parse_headers(buf, buf_end, headers, num_headers, max_headers, &r)) == NULL) {
-        return r;
-    }
+    if ((r = parse_headers_iov(&reader, headers, num_headers, max_headers)) != 0)
+        return count_partial(r);
 
-    return (int)(buf - buf_start);
+    return (int)reader.consumed;
 }
 
 enum {
@@ -529,29 +2194,53 @@ enum {
     CHUNKED_IN_TRAILERS_LINE_MIDDLE
 };
 
-static int decode_hex(int ch)
+/* values of hex digits, or -1 for other characters */
+static const signed char hex_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+static ALWAYS_INLINE int decode_hex(int ch)
 {
-    if ('0' <= ch && ch <= '9') {
-        return ch - '0';
-    } else if ('A' <= ch && ch <= 'F') {
-        return ch - 'A' + 0xa;
-    } else if ('a' <= ch && ch <= 'f') {
-        return ch - 'a' + 0xa;
-    } else {
-        return -1;
-    }
+    return hex_values[(unsigned char)ch];
 }
 
-ssize_t phr_decode_chunked(struct phr_chunked_decoder *decoder, char *buf, size_t *_bufsz)
+/* Implements phr_decode_chunked and its variants. The chunk data is either moved to the front of the buffer, recorded to `spans`
+ * if the argument is non-NULL, or skipped if `discard` is set; in the latter cases, the buffer is not modified, and `*_bufsz` is
+ * set to the number of bytes being consumed. `dst` counts the chunk data in any case, so that the skipped data is not mistaken as
+ * the overhead. If `exts` or `trailers` is non-NULL (which requires `spans`), the chunk extensions or the trailers are also
+ * returned, and the chunk header lines or the trailer section are consumed only when complete, so that they can be referred to
+ * within the buffer. */
+static ALWAYS_INLINE ssize_t decode_chunked(struct phr_chunked_decoder *decoder, char *buf, size_t *_bufsz,
+                                            struct phr_chunked_span *spans, size_t *num_spans, struct phr_chunked_span *exts,
+                                            size_t *num_exts, struct phr_header *trailers, size_t *num_trailers)
 {
-    size_t dst = 0, src = 0, bufsz = *_bufsz;
+    size_t dst = 0, src = 0, bufsz = *_bufsz, max_spans = 0, max_exts = 0, max_trailers = 0, line_start = 0;
     ssize_t ret = -2; /* incomplete */
 
-    decoder->_total_read += bufsz;
+    if (spans != NULL) {
+        max_spans = *num_spans;
+        *num_spans = 0;
+    }
+    if (exts != NULL) {
+        max_exts = *num_exts;
+        *num_exts = 0;
+    }
+    if (trailers != NULL) {
+        max_trailers = *num_trailers;
+        *num_trailers = 0;
+    }
 
     while (1) {
         switch (decoder->_state) {
         case CHUNKED_IN_CHUNK_SIZE:
+            line_start = src;
             for (;; ++src) {
                 int v;
                 if (src == bufsz)
@@ -585,8 +2274,12 @@ ssize_t phr_decode_chunked(struct phr_chunked_decoder *decoder, char *buf, size_
             decoder->_hex_count = 0;
             decoder->_state = CHUNKED_IN_CHUNK_EXT;
         /* fallthru */
-        case CHUNKED_IN_CHUNK_EXT:
+        case CHUNKED_IN_CHUNK_EXT: {
             /* RFC 7230 A.2 "Line folding in chunk extensions is disallowed" */
+            size_t ext_start = src;
+            int found;
+            if (src != bufsz && buf[src] != '\015')
+                src = kernel->find_ctl(buf + src, buf + bufsz, &found) - buf;
             for (;; ++src) {
                 if (src == bufsz)
                     goto Exit;
@@ -597,8 +2290,20 @@ ssize_t phr_decode_chunked(struct phr_chunked_decoder *decoder, char *buf, size_
                     goto Exit;
                 }
             }
+            if (exts != NULL) {
+                while (ext_start != src && (buf[ext_start] == ' ' || buf[ext_start] == '\011'))
+                    ++ext_start;
+                if (ext_start != src) {
+                    if (*num_exts == max_exts)
+                        goto Exit;
+                    exts[*num_exts].off = ext_start;
+                    exts[*num_exts].len = src - ext_start;
+                    ++*num_exts;
+                }
+            }
             ++src;
             decoder->_state = CHUNKED_IN_CHUNK_HEADER_EXPECT_LF;
+        }
         /* fallthru */
         case CHUNKED_IN_CHUNK_HEADER_EXPECT_LF:
             if (src == bufsz)
@@ -609,7 +2314,7 @@ ssize_t phr_decode_chunked(struct phr_chunked_decoder *decoder, char *buf, size_
             }
             ++src;
             if (decoder->bytes_left_in_chunk == 0) {
-                if (decoder->consume_trailer) {
+                if (decoder->consume_trailer || trailers != NULL) {
                     decoder->_state = CHUNKED_IN_TRAILERS_LINE_HEAD;
                     break;
                 } else {
@@ -619,20 +2324,25 @@ ssize_t phr_decode_chunked(struct phr_chunked_decoder *decoder, char *buf, size_
             decoder->_state = CHUNKED_IN_CHUNK_DATA;
         /* fallthru */
         case CHUNKED_IN_CHUNK_DATA: {
-            size_t avail = bufsz - src;
-            if (avail < decoder->bytes_left_in_chunk) {
-                if (dst != src)
-                    memmove(buf + dst, buf + src, avail);
-                src += avail;
-                dst += avail;
-                decoder->bytes_left_in_chunk -= avail;
+            size_t avail = bufsz - src, n = avail < decoder->bytes_left_in_chunk ? avail : decoder->bytes_left_in_chunk;
+            if (n == 0)
                 goto Exit;
+            if (spans == NULL) {
+                if (dst != src && !decoder->discard) {
+                    memmove(buf + dst, buf + src, n);
+                    STATS_ADD(chunked_memmove_bytes, n);
+                }
+            } else {
+                if (*num_spans == max_spans)
+                    goto Exit;
+                spans[*num_spans].off = src;
+                spans[*num_spans].len = n;
+                ++*num_spans;
             }
-            if (dst != src)
-                memmove(buf + dst, buf + src, decoder->bytes_left_in_chunk);
-            src += decoder->bytes_left_in_chunk;
-            dst += decoder->bytes_left_in_chunk;
-            decoder->bytes_left_in_chunk = 0;
+            src += n;
+            dst += n;
+            if ((decoder->bytes_left_in_chunk -= n) != 0)
+                goto Exit;
             decoder->_state = CHUNKED_IN_CHUNK_DATA_EXPECT_CR;
         }
         /* fallthru */
@@ -657,6 +2367,18 @@ ssize_t phr_decode_chunked(struct phr_chunked_decoder *decoder, char *buf, size_
             decoder->_state = CHUNKED_IN_CHUNK_SIZE;
             break;
         case CHUNKED_IN_TRAILERS_LINE_HEAD:
+            if (trailers != NULL) {
+                /* parse the trailer section at once, as phr_parse_headers does */
+                const char *end;
+                int r;
+                if ((end = parse_headers(buf + src, buf + bufsz, trailers, NULL, NULL, num_trailers, max_trailers, &r)) == NULL) {
+                    *num_trailers = 0;
+                    ret = r;
+                    goto Exit;
+                }
+                src = end - buf;
+                goto Complete;
+            }
             for (;; ++src) {
                 if (src == bufsz)
                     goto Exit;
@@ -667,7 +2389,9 @@ ssize_t phr_decode_chunked(struct phr_chunked_decoder *decoder, char *buf, size_
                 goto Complete;
             decoder->_state = CHUNKED_IN_TRAILERS_LINE_MIDDLE;
         /* fallthru */
-        case CHUNKED_IN_TRAILERS_LINE_MIDDLE:
+        case CHUNKED_IN_TRAILERS_LINE_MIDDLE: {
+            int found;
+            src = kernel->find_ctl(buf + src, buf + bufsz, &found) - buf;
             for (;; ++src) {
                 if (src == bufsz)
                     goto Exit;
@@ -676,7 +2400,7 @@ ssize_t phr_decode_chunked(struct phr_chunked_decoder *decoder, char *buf, size_
             }
             ++src;
             decoder->_state = CHUNKED_IN_TRAILERS_LINE_HEAD;
-            break;
+        } break;
         default:
             assert(!"decoder is corrupt");
         }
@@ -685,23 +2409,278 @@ ssize_t phr_decode_chunked(struct phr_chunked_decoder *decoder, char *buf, size_
 Complete:
     ret = bufsz - src;
 Exit:
-    if (dst != src)
-        memmove(buf + dst, buf + src, bufsz - src);
-    *_bufsz = dst;
+    if (exts != NULL && ret == -2 &&
+        (decoder->_state == CHUNKED_IN_CHUNK_SIZE || decoder->_state == CHUNKED_IN_CHUNK_EXT)) {
+        /* leave the chunk header line being incomplete to the next call */
+        decoder->bytes_left_in_chunk = 0;
+        decoder->_hex_count = 0;
+        decoder->_state = CHUNKED_IN_CHUNK_SIZE;
+        src = line_start;
+    }
+    if (spans == NULL && !decoder->discard) {
+        if (dst != src) {
+            memmove(buf + dst, buf + src, bufsz - src);
+            STATS_ADD(chunked_memmove_bytes, bufsz - src);
+        }
+        decoder->_total_read += bufsz;
+        *_bufsz = dst;
+    } else {
+        decoder->_total_read += src;
+        *_bufsz = src;
+    }
     /* if incomplete but the overhead of the chunked encoding is >=100KB and >80%, signal an error */
     if (ret == -2) {
-        decoder->_total_overhead += bufsz - dst;
+        decoder->_total_overhead += src - dst;
         if (decoder->_total_overhead >= 100 * 1024 && decoder->_total_read - decoder->_total_overhead < decoder->_total_read / 4)
             ret = -1;
     }
     return ret;
 }
 
+ssize_t phr_decode_chunked(struct phr_chunked_decoder *decoder, char *buf, size_t *bufsz)
+{
+    return decode_chunked(decoder, buf, bufsz, NULL, NULL, NULL, NULL, NULL, NULL);
+}
+
+ssize_t phr_decode_chunked_spans(struct phr_chunked_decoder *decoder, const char *buf, size_t *bufsz,
+                                 struct phr_chunked_span *spans, size_t *num_spans)
+{
+    /* the buffer is not modified when `spans` is given */
+    return decode_chunked(decoder, (char *)buf, bufsz, spans, num_spans, NULL, NULL, NULL, NULL);
+}
+
+ssize_t phr_decode_chunked_metadata(struct phr_chunked_decoder *decoder, const char *buf, size_t *bufsz,
+                                    struct phr_chunked_span *spans, size_t *num_spans, struct phr_chunked_span *exts,
+                                    size_t *num_exts, struct phr_header *trailers, size_t *num_trailers)
+{
+    return decode_chunked(decoder, (char *)buf, bufsz, spans, num_spans, exts, num_exts, trailers, num_trailers);
+}
+
+ssize_t phr_decode_chunked_iov(struct phr_chunked_decoder *decoder, struct phr_iovec *iov, size_t *iovcnt)
+{
+    size_t i, j, bufsz;
+    ssize_t ret = -2;
+
+    /* the decoder keeps its state across the segments, the same way as it does across the calls */
+    for (i = 0; i != *iovcnt; ++i) {
+        bufsz = iov[i].len;
+        ret = phr_decode_chunked(decoder, iov[i].base, &bufsz);
+        if (decoder->discard) {
+            /* nothing is decoded; the segment becomes empty, located at the end of the bytes being consumed */
+            iov[i].base += bufsz;
+            bufsz = 0;
+        }
+        iov[i].len = bufsz;
+        if (ret == -1)
+            return ret;
+        if (ret >= 0) {
+            /* the segments that follow are left undecoded */
+            for (j = i + 1; j != *iovcnt; ++j)
+                ret += iov[j].len;
+            *iovcnt = i + 1;
+            return ret;
+        }
+    }
+    return ret;
+}
+
 int phr_decode_chunked_is_in_data(struct phr_chunked_decoder *decoder)
 {
     return decoder->_state == CHUNKED_IN_CHUNK_DATA;
 }
 
+void phr_body_reader_init(struct phr_body_reader *reader, int type, size_t content_length)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->type = type == PHR_BODY_CONTENT_LENGTH && content_length == 0 ? PHR_BODY_NONE : type;
+    reader->bytes_left = content_length;
+    reader->_chunked.consume_trailer = 1;
+}
+
+void phr_body_reader_init_request(struct phr_body_reader *reader, const struct phr_framing *framing)
+{
+    /* phr_parse_request_framing rejects requests whose final transfer coding is not chunked */
+    if ((framing->flags & PHR_FRAMING_CHUNKED) != 0) {
+        phr_body_reader_init(reader, PHR_BODY_CHUNKED, 0);
+    } else if ((framing->flags & PHR_FRAMING_CONTENT_LENGTH) != 0) {
+        phr_body_reader_init(reader, PHR_BODY_CONTENT_LENGTH, framing->content_length);
+    } else {
+        phr_body_reader_init(reader, PHR_BODY_NONE, 0);
+    }
+}
+
+void phr_body_reader_init_response(struct phr_body_reader *reader, const struct phr_framing *framing, int status,
+                                   int head_request)
+{
+    /* RFC 9112 6.3 */
+    if (head_request || status < 200 || status == 204 || status == 304) {
+        phr_body_reader_init(reader, PHR_BODY_NONE, 0);
+    } else if ((framing->flags & PHR_FRAMING_CHUNKED) != 0) {
+        phr_body_reader_init(reader, PHR_BODY_CHUNKED, 0);
+    } else if ((framing->flags & (PHR_FRAMING_TRANSFER_ENCODING | PHR_FRAMING_CONTENT_LENGTH)) == PHR_FRAMING_CONTENT_LENGTH) {
+        phr_body_reader_init(reader, PHR_BODY_CONTENT_LENGTH, framing->content_length);
+    } else {
+        phr_body_reader_init(reader, PHR_BODY_UNTIL_CLOSE, 0);
+    }
+}
+
+ssize_t phr_body_reader_read(struct phr_body_reader *reader, const char *buf, size_t *bufsz, struct phr_chunked_span *spans,
+                             size_t *num_spans)
+{
+    size_t avail = *bufsz, max_spans = *num_spans, n;
+    ssize_t ret;
+
+    *num_spans = 0;
+
+    switch (reader->type) {
+    case PHR_BODY_NONE:
+        *bufsz = 0;
+        return (ssize_t)avail;
+    case PHR_BODY_CONTENT_LENGTH:
+    case PHR_BODY_UNTIL_CLOSE:
+        /* the payload is the input itself, up to the end of the body */
+        n = reader->type == PHR_BODY_CONTENT_LENGTH && reader->bytes_left < avail ? reader->bytes_left : avail;
+        if (n != 0 && spans != NULL) {
+            if (max_spans == 0) {
+                *bufsz = 0;
+                return -2;
+            }
+            spans[0].off = 0;
+            spans[0].len = n;
+            *num_spans = 1;
+        }
+        *bufsz = n;
+        if (reader->type == PHR_BODY_UNTIL_CLOSE || (reader->bytes_left -= n) != 0)
+            return -2;
+        reader->type = PHR_BODY_NONE;
+        return (ssize_t)(avail - n);
+    case PHR_BODY_CHUNKED:
+        if (spans != NULL)
+            *num_spans = max_spans;
+        reader->_chunked.discard = spans == NULL;
+        if ((ret = decode_chunked(&reader->_chunked, (char *)buf, bufsz, spans, num_spans, NULL, NULL, NULL, NULL)) >= 0)
+            reader->type = PHR_BODY_NONE;
+        return ret;
+    default:
+        assert(!"reader is corrupt");
+        return -1;
+    }
+}
+
+int phr_body_reader_eof(struct phr_body_reader *reader)
+{
+    return reader->type == PHR_BODY_NONE || reader->type == PHR_BODY_UNTIL_CLOSE ? 0 : -1;
+}
+
+enum { CONN_IN_HEAD, CONN_IN_BODY, CONN_BODY_END, CONN_CLOSED, CONN_UPGRADED };
+
+void phr_conn_init(struct phr_conn *conn, char *buf, size_t capacity, struct phr_header *headers, size_t max_headers)
+{
+    memset(conn, 0, sizeof(*conn));
+    conn->buf = buf;
+    conn->capacity = capacity;
+    conn->headers = headers;
+    conn->max_headers = max_headers;
+    conn->_state = CONN_IN_HEAD;
+}
+
+char *phr_conn_reserve(struct phr_conn *conn, size_t *len)
+{
+    if (conn->_start == conn->_end) {
+        /* everything has been consumed; rewind without moving anything */
+        conn->_start = conn->_end = 0;
+    } else if (conn->capacity - conn->_end < conn->_start) {
+        /* move the partial message to the front, only when it gains more space than is left at the tail */
+        memmove(conn->buf, conn->buf + conn->_start, conn->_end - conn->_start);
+        STATS_ADD(conn_memmove_bytes, conn->_end - conn->_start);
+        conn->_end -= conn->_start;
+        conn->_start = 0;
+    }
+
+    if ((*len = conn->capacity - conn->_end) == 0)
+        return NULL;
+    return conn->buf + conn->_end;
+}
+
+void phr_conn_received(struct phr_conn *conn, size_t len)
+{
+    assert(len <= conn->capacity - conn->_end);
+    conn->_end += len;
+}
+
+int phr_conn_next(struct phr_conn *conn, struct phr_conn_event *event)
+{
+    struct phr_request *req = &event->request;
+    struct phr_chunked_span span;
+    size_t bufsz, num_spans;
+    ssize_t ret;
+    int r;
+
+    switch (conn->_state) {
+    case CONN_IN_HEAD:
+        req->headers = conn->headers;
+        req->num_headers = conn->max_headers;
+        /* when called again for a partial request head, the check for the end of the head resumes from where it stopped */
+        if ((r = phr_parse_request_framing(conn->buf + conn->_start, conn->_end - conn->_start, &req->method, &req->method_len,
+                                           &req->path, &req->path_len, &req->minor_version, req->headers, &req->num_headers,
+                                           &req->framing, conn->_last_len)) < 0) {
+            if (r == -2)
+                conn->_last_len = conn->_end - conn->_start;
+            return r;
+        }
+        conn->_start += r;
+        conn->_last_len = 0;
+        conn->_discard_body = 0;
+        conn->_keep_alive = (req->framing.flags & PHR_FRAMING_CONNECTION_CLOSE) == 0 &&
+                            (req->minor_version >= 1 || (req->framing.flags & PHR_FRAMING_CONNECTION_KEEP_ALIVE) != 0);
+        conn->_upgrade = switches_protocols(req);
+        phr_body_reader_init_request(&conn->_body, &req->framing);
+        conn->_state = conn->_body.type == PHR_BODY_NONE ? CONN_BODY_END : CONN_IN_BODY;
+        event->keep_alive = conn->_keep_alive;
+        return PHR_CONN_EVENT_REQUEST;
+    case CONN_IN_BODY:
+        bufsz = conn->_end - conn->_start;
+        num_spans = 1;
+        if ((ret = phr_body_reader_read(&conn->_body, conn->buf + conn->_start, &bufsz, conn->_discard_body ? NULL : &span,
+                                        &num_spans)) == -1)
+            return -1;
+        if (ret >= 0)
+            conn->_state = CONN_BODY_END;
+        if (num_spans != 0) {
+            event->body = conn->buf + conn->_start + span.off;
+            event->body_len = span.len;
+            conn->_start += bufsz;
+            return PHR_CONN_EVENT_BODY;
+        }
+        conn->_start += bufsz;
+        if (ret < 0)
+            return -2;
+    /* fallthru */
+    case CONN_BODY_END:
+        /* the bytes that follow a request switching protocols are never parsed as the next request */
+        conn->_state = conn->_upgrade ? CONN_UPGRADED : conn->_keep_alive ? CONN_IN_HEAD : CONN_CLOSED;
+        return PHR_CONN_EVENT_BODY_END;
+    case CONN_CLOSED:
+        return PHR_CONN_EVENT_CLOSE;
+    case CONN_UPGRADED:
+        return PHR_CONN_EVENT_UPGRADE;
+    default:
+        assert(!"conn is corrupt");
+        return -1;
+    }
+}
+
+void phr_conn_discard_body(struct phr_conn *conn)
+{
+    conn->_discard_body = 1;
+}
+
+const char *phr_conn_pending(const struct phr_conn *conn, size_t *len)
+{
+    *len = conn->_end - conn->_start;
+    return conn->buf + conn->_start;
+}
+
 #undef CHECK_EOF
 #undef EXPECT_CHAR
 #undef ADVANCE_TOKEN
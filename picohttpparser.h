@@ -59,10 +59,317 @@ int phr_parse_response(const char *_buf, size_t len, int *minor_version, int *st
 /* ditto */
 int phr_parse_headers(const char *buf, size_t len, struct phr_header *headers, size_t *num_headers, size_t last_len);
 
+/* IDs of the well-known header names */
+enum {
+    PHR_HEADER_UNKNOWN = 0,
+    PHR_HEADER_ACCEPT,
+    PHR_HEADER_ACCEPT_CHARSET,
+    PHR_HEADER_ACCEPT_ENCODING,
+    PHR_HEADER_ACCEPT_LANGUAGE,
+    PHR_HEADER_ACCEPT_RANGES,
+    PHR_HEADER_ACCESS_CONTROL_ALLOW_ORIGIN,
+    PHR_HEADER_AGE,
+    PHR_HEADER_ALLOW,
+    PHR_HEADER_AUTHORIZATION,
+    PHR_HEADER_CACHE_CONTROL,
+    PHR_HEADER_CONNECTION,
+    PHR_HEADER_CONTENT_DISPOSITION,
+    PHR_HEADER_CONTENT_ENCODING,
+    PHR_HEADER_CONTENT_LANGUAGE,
+    PHR_HEADER_CONTENT_LENGTH,
+    PHR_HEADER_CONTENT_LOCATION,
+    PHR_HEADER_CONTENT_RANGE,
+    PHR_HEADER_CONTENT_TYPE,
+    PHR_HEADER_COOKIE,
+    PHR_HEADER_DATE,
+    PHR_HEADER_ETAG,
+    PHR_HEADER_EXPECT,
+    PHR_HEADER_EXPIRES,
+    PHR_HEADER_FORWARDED,
+    PHR_HEADER_FROM,
+    PHR_HEADER_HOST,
+    PHR_HEADER_HTTP2_SETTINGS,
+    PHR_HEADER_IF_MATCH,
+    PHR_HEADER_IF_MODIFIED_SINCE,
+    PHR_HEADER_IF_NONE_MATCH,
+    PHR_HEADER_IF_RANGE,
+    PHR_HEADER_IF_UNMODIFIED_SINCE,
+    PHR_HEADER_KEEP_ALIVE,
+    PHR_HEADER_LAST_MODIFIED,
+    PHR_HEADER_LINK,
+    PHR_HEADER_LOCATION,
+    PHR_HEADER_MAX_FORWARDS,
+    PHR_HEADER_ORIGIN,
+    PHR_HEADER_PROXY_AUTHENTICATE,
+    PHR_HEADER_PROXY_AUTHORIZATION,
+    PHR_HEADER_PROXY_CONNECTION,
+    PHR_HEADER_RANGE,
+    PHR_HEADER_REFERER,
+    PHR_HEADER_REFRESH,
+    PHR_HEADER_RETRY_AFTER,
+    PHR_HEADER_SERVER,
+    PHR_HEADER_SET_COOKIE,
+    PHR_HEADER_STRICT_TRANSPORT_SECURITY,
+    PHR_HEADER_TE,
+    PHR_HEADER_TRAILER,
+    PHR_HEADER_TRANSFER_ENCODING,
+    PHR_HEADER_UPGRADE,
+    PHR_HEADER_UPGRADE_INSECURE_REQUESTS,
+    PHR_HEADER_USER_AGENT,
+    PHR_HEADER_VARY,
+    PHR_HEADER_VIA,
+    PHR_HEADER_WWW_AUTHENTICATE,
+    PHR_HEADER_X_FORWARDED_FOR,
+    PHR_HEADER_X_FORWARDED_PROTO,
+    PHR_HEADER_X_REAL_IP,
+    PHR_HEADER_NUM_IDS
+};
+
+/* returns the ID of a header name (compared case-insensitively), or PHR_HEADER_UNKNOWN; the name must consist of token characters,
+ * as is the case for the names returned by the functions below */
+int phr_lookup_header(const char *name, size_t name_len);
+
+/* Same as phr_parse_request, phr_parse_response and phr_parse_headers, but also store the ID of each header name to `header_ids`,
+ * an array having the same capacity as `headers`. The ID of a continuation line (i.e. `name` being NULL) is PHR_HEADER_UNKNOWN. */
+int phr_parse_request_with_ids(const char *buf, size_t len, const char **method, size_t *method_len, const char **path,
+                               size_t *path_len, int *minor_version, struct phr_header *headers, int *header_ids,
+                               size_t *num_headers, size_t last_len);
+
+/* ditto */
+int phr_parse_response_with_ids(const char *_buf, size_t len, int *minor_version, int *status, const char **msg, size_t *msg_len,
+                                struct phr_header *headers, int *header_ids, size_t *num_headers, size_t last_len);
+
+/* ditto */
+int phr_parse_headers_with_ids(const char *buf, size_t len, struct phr_header *headers, int *header_ids, size_t *num_headers,
+                               size_t last_len);
+
+/* framing-related semantics of a message, extracted by phr_parse_request_framing and phr_parse_response_framing */
+struct phr_framing {
+    size_t content_length; /* value of Content-Length, valid if PHR_FRAMING_CONTENT_LENGTH is set */
+    int flags;             /* PHR_FRAMING_* */
+};
+
+#define PHR_FRAMING_CONTENT_LENGTH 0x1         /* has Content-Length */
+#define PHR_FRAMING_TRANSFER_ENCODING 0x2      /* has Transfer-Encoding */
+#define PHR_FRAMING_CHUNKED 0x4                /* final transfer coding is chunked */
+#define PHR_FRAMING_CONNECTION_CLOSE 0x8       /* Connection: close */
+#define PHR_FRAMING_CONNECTION_KEEP_ALIVE 0x10 /* Connection: keep-alive */
+#define PHR_FRAMING_CONNECTION_UPGRADE 0x20    /* Connection: upgrade */
+#define PHR_FRAMING_EXPECT_CONTINUE 0x40       /* Expect: 100-continue */
+
+/* Same as phr_parse_request and phr_parse_response, but also extract the semantics of the header fields that determine the framing
+ * of the message into `framing`. In addition to the errors detected by the functions above, -1 is returned if Content-Length is
+ * invalid, overflows, or has different values, if Transfer-Encoding or Content-Length is folded, if both Transfer-Encoding and
+ * Content-Length are present, or if the final transfer coding of a request is not chunked. */
+int phr_parse_request_framing(const char *buf, size_t len, const char **method, size_t *method_len, const char **path,
+                              size_t *path_len, int *minor_version, struct phr_header *headers, size_t *num_headers,
+                              struct phr_framing *framing, size_t last_len);
+
+/* ditto */
+int phr_parse_response_framing(const char *_buf, size_t len, int *minor_version, int *status, const char **msg, size_t *msg_len,
+                               struct phr_header *headers, size_t *num_headers, struct phr_framing *framing, size_t last_len);
+
+/* a request parsed by phr_parse_requests_batch */
+struct phr_request {
+    const char *method;
+    size_t method_len;
+    const char *path;
+    size_t path_len;
+    int minor_version;
+    struct phr_header *headers; /* points to the slice of the headers array being used by the request */
+    size_t num_headers;
+    struct phr_framing framing;
+};
+
+/* Parses the pipelined requests in the buffer, storing up to `*num_requests` requests and up to `*num_headers` headers in total.
+ * Returns the number of bytes consumed by the requests being parsed, setting `*num_requests` and `*num_headers` to the number of
+ * entries being used. Parsing stops before a request that is incomplete, invalid, or cannot be stored, and after a request whose
+ * framing tells that the following bytes are not the next request (i.e. having a body, or switching protocols). -1 or -2 is
+ * returned if the first request is invalid or incomplete, as phr_parse_request_framing does. */
+int phr_parse_requests_batch(const char *buf, size_t len, struct phr_request *requests, size_t *num_requests,
+                             struct phr_header *headers, size_t *num_headers);
+
+/* compact representation of a header being 12 bytes long, using offsets from the beginning of the buffer instead of pointers
+ * (name_len == 0 if is a continuing line of a multiline header) */
+struct phr_header_compact {
+    uint32_t name_off;
+    uint32_t value_off;
+    uint16_t name_len;
+    uint16_t value_len;
+};
+
+/* Same as phr_parse_request, phr_parse_response and phr_parse_headers, but store the headers in the compact representation, so
+ * that the buffer can be moved without fixing up the headers. -1 is returned if the name or the value of a header is longer than
+ * 65535 bytes, or if its offset does not fit in 32 bits. */
+int phr_parse_request_compact(const char *buf, size_t len, const char **method, size_t *method_len, const char **path,
+                              size_t *path_len, int *minor_version, struct phr_header_compact *headers, size_t *num_headers,
+                              size_t last_len);
+
+/* ditto */
+int phr_parse_response_compact(const char *_buf, size_t len, int *minor_version, int *status, const char **msg, size_t *msg_len,
+                               struct phr_header_compact *headers, size_t *num_headers, size_t last_len);
+
+/* ditto */
+int phr_parse_headers_compact(const char *buf, size_t len, struct phr_header_compact *headers, size_t *num_headers,
+                              size_t last_len);
+
+/* keeps the progress of the phr_parse_*_incremental functions; should be zero-filled before parsing each message */
+struct phr_parse_state {
+    size_t _pos;         /* offset of the first line that has not been parsed, or zero if nothing has been parsed */
+    size_t _headers_pos; /* offset of the first header line */
+    size_t _num_headers; /* number of headers that have been parsed */
+    uintptr_t _buf;      /* address of the buffer supplied by the previous call, compared for telling if the buffer has moved */
+};
+
+/* Incremental variants of phr_parse_request, phr_parse_response and phr_parse_headers. When the input is partial, the progress is
+ * saved in `state`, and the next call resumes from the first line that has not been parsed, instead of reparsing the input from
+ * the beginning. Between the calls, the newly arrived bytes should be appended to the buffer, and `headers` must retain the values
+ * set by the previous call. The buffer may be moved (e.g., by `realloc`) between the calls, in which case the headers are parsed
+ * again from the new buffer; the request line or the status line is parsed by every call. `*num_headers` should be set to the
+ * capacity of `headers` every time, as is the case for the functions above. */
+int phr_parse_request_incremental(struct phr_parse_state *state, const char *buf, size_t len, const char **method,
+                                  size_t *method_len, const char **path, size_t *path_len, int *minor_version,
+                                  struct phr_header *headers, size_t *num_headers);
+
+/* ditto */
+int phr_parse_response_incremental(struct phr_parse_state *state, const char *buf, size_t len, int *minor_version, int *status,
+                                   const char **msg, size_t *msg_len, struct phr_header *headers, size_t *num_headers);
+
+/* ditto */
+int phr_parse_headers_incremental(struct phr_parse_state *state, const char *buf, size_t len, struct phr_header *headers,
+                                  size_t *num_headers);
+
+/* a segment of the input */
+struct phr_iovec {
+    char *base;
+    size_t len;
+};
+
+/* Same as phr_parse_request, phr_parse_response and phr_parse_headers, but parse the input given as an array of segments (e.g.,
+ * those of a ring buffer). The names and the values point into the segments, except for the lines that straddle the segments,
+ * which are copied into the scratch buffer being supplied; -1 is returned if the scratch buffer runs short. The return value is
+ * the number of bytes being consumed in total. Unlike the functions above, slowloris is not checked (i.e. no `last_len`). */
+int phr_parse_request_iov(const struct phr_iovec *iov, size_t iovcnt, char *scratch, size_t scratch_len, const char **method,
+                          size_t *method_len, const char **path, size_t *path_len, int *minor_version, struct phr_header *headers,
+                          size_t *num_headers);
+
+/* ditto */
+int phr_parse_response_iov(const struct phr_iovec *iov, size_t iovcnt, char *scratch, size_t scratch_len, int *minor_version,
+                           int *status, const char **msg, size_t *msg_len, struct phr_header *headers, size_t *num_headers);
+
+/* ditto */
+int phr_parse_headers_iov(const struct phr_iovec *iov, size_t iovcnt, char *scratch, size_t scratch_len, struct phr_header *headers,
+                          size_t *num_headers);
+
+/* Same as phr_parse_request, phr_parse_response and phr_parse_headers, but store only the headers whose names are listed in
+ * `wanted` (an array of `num_wanted` NUL-terminated names, which are compared case-insensitively), along with their continuation
+ * lines. The names of all the headers are validated as phr_parse_headers does, but the values of the other headers are skipped by
+ * searching for the end of line without being validated or trimmed; such a value may contain a bare CR or control characters that
+ * phr_parse_headers rejects. */
+int phr_parse_request_selective(const char *buf, size_t len, const char **method, size_t *method_len, const char **path,
+                                size_t *path_len, int *minor_version, const char *const *wanted, size_t num_wanted,
+                                struct phr_header *headers, size_t *num_headers, size_t last_len);
+
+/* ditto */
+int phr_parse_response_selective(const char *_buf, size_t len, int *minor_version, int *status, const char **msg, size_t *msg_len,
+                                 const char *const *wanted, size_t num_wanted, struct phr_header *headers, size_t *num_headers,
+                                 size_t last_len);
+
+/* ditto */
+int phr_parse_headers_selective(const char *buf, size_t len, const char *const *wanted, size_t num_wanted,
+                                struct phr_header *headers, size_t *num_headers, size_t last_len);
+
+/* header block of a message parsed by phr_parse_request_lazy or phr_parse_response_lazy */
+struct phr_lazy_headers {
+    const char *_start; /* beginning of the first header line */
+    const char *_end;   /* end of the header block, being right after the empty line */
+};
+
+/* Same as phr_parse_request and phr_parse_response, but only parse the request line or the status line and locate the end of the
+ * header block. The headers are split and validated when they are accessed using phr_lazy_next_header or phr_lazy_split_headers,
+ * and therefore the input must be retained while they are in use. The line endings are checked against the policies (see
+ * PHR_REQUIRE_CRLF) when the end is located, so that the end is never found where phr_parse_request would reject the input. */
+int phr_parse_request_lazy(const char *buf, size_t len, const char **method, size_t *method_len, const char **path,
+                           size_t *path_len, int *minor_version, struct phr_lazy_headers *headers, size_t last_len);
+
+/* ditto */
+int phr_parse_response_lazy(const char *_buf, size_t len, int *minor_version, int *status, const char **msg, size_t *msg_len,
+                            struct phr_lazy_headers *headers, size_t last_len);
+
+/* Parses the header that starts at `*cursor` (being zero for the first header), advancing the cursor to the next one. Returns 1 if
+ * a header is stored to `header`, 0 if there are no more headers, or -1 if the header is malformed. */
+int phr_lazy_next_header(const struct phr_lazy_headers *headers, size_t *cursor, struct phr_header *header);
+
+/* Parses all the headers, storing them to the array given as (headers, num_headers) in the same way as phr_parse_headers does.
+ * Returns 0 if successful, or -1 if a header is malformed or there are more headers than the array can hold. */
+int phr_lazy_split_headers(const struct phr_lazy_headers *lazy, struct phr_header *headers, size_t *num_headers);
+
+/* values to be returned by phr_header_cb */
+#define PHR_CB_CONTINUE 0 /* continue parsing */
+#define PHR_CB_SKIP 1     /* skip to the end of the header block, without reporting nor validating the remaining headers */
+#define PHR_CB_STOP 2     /* stop parsing; the parse function returns -3 */
+
+/* called for each header; continuation lines of a multiline header are reported as headers with `name` set to NULL */
+typedef int (*phr_header_cb)(void *cb_data, const struct phr_header *header);
+
+/* Same as phr_parse_request, phr_parse_response and phr_parse_headers, but instead of storing the headers to an array, report each
+ * of them to `cb` as soon as it is parsed; therefore, the number of headers is not limited. Returns -3 if the callback returns
+ * PHR_CB_STOP. When the input is partial (i.e. -2 is returned), the callback might have been called for the headers that have been
+ * received; they are reported again by the next call, which parses the input from the beginning. */
+int phr_parse_request_cb(const char *buf, size_t len, const char **method, size_t *method_len, const char **path, size_t *path_len,
+                         int *minor_version, phr_header_cb cb, void *cb_data, size_t last_len);
+
+/* ditto */
+int phr_parse_response_cb(const char *_buf, size_t len, int *minor_version, int *status, const char **msg, size_t *msg_len,
+                          phr_header_cb cb, void *cb_data, size_t last_len);
+
+/* ditto */
+int phr_parse_headers_cb(const char *buf, size_t len, phr_header_cb cb, void *cb_data, size_t last_len);
+
+/* searches for the end of the header block (i.e. two consecutive line endings), returning the number of bytes up to and including
+ * the terminating LF, -2 if not found, or -1 if a CR not followed by LF is found. The search starts three bytes before `last_len`
+ * so that a terminator being split across the previous and the newly arrived data is found. */
+int phr_find_headers_end(const char *buf, size_t len, size_t last_len);
+
+/* kernels used for scanning the input */
+#define PHR_KERNEL_AUTO -1 /* the preferred kernel supported by the CPU (AVX2, AVX-512, SSE4.2, then scalar) */
+#define PHR_KERNEL_SCALAR 0
+#define PHR_KERNEL_SSE42 1
+#define PHR_KERNEL_AVX2 2
+#define PHR_KERNEL_AVX512 3
+
+/* returns the kernel being used (one of PHR_KERNEL_*); by default, the preferred kernel is selected at startup */
+int phr_get_kernel(void);
+
+/* selects the kernel to be used. Returns 0 if successful, or -1 if the kernel is not available in the build or not supported by the
+ * CPU. The function is not thread-safe; it should be called before the parser is used. */
+int phr_set_kernel(int kernel);
+
+/* counters of the events on the hot paths; see phr_get_stats */
+struct phr_stats {
+    uint64_t simd_bytes;            /* bytes checked by the SIMD code of the kernels */
+    uint64_t swar_bytes;            /* bytes checked by the SWAR code (i.e. the scalar kernel and the tails of the SIMD kernels) */
+    uint64_t tail_bytes;            /* bytes at the end of input left unchecked by the kernels, which are then checked one by one */
+    uint64_t token_map_fallbacks;   /* tchars that are not classified by the kernels, and are therefore checked using a table */
+    uint64_t partial_returns;       /* number of times the parse functions returned -2 */
+    uint64_t rescanned_bytes;       /* bytes scanned again because the parse functions are called again after returning -2 */
+    uint64_t incomplete_rejections; /* number of times the check done when `last_len` is non-zero rejected the input */
+    uint64_t chunked_memmove_bytes; /* bytes moved by phr_decode_chunked */
+    uint64_t conn_memmove_bytes;    /* bytes moved by phr_conn_reserve to compact the buffer */
+};
+
+/* Copies the counters of the calling thread to `stats`. The counters are maintained only when the library is compiled with
+ * PHR_ENABLE_STATS defined; otherwise, they are always zero and the parser does not pay for them. */
+void phr_get_stats(struct phr_stats *stats);
+
+/* resets the counters of the calling thread */
+void phr_reset_stats(void);
+
 /* should be zero-filled before start */
 struct phr_chunked_decoder {
     size_t bytes_left_in_chunk; /* number of bytes left in current chunk */
     char consume_trailer;       /* if trailing headers should be consumed */
+    char discard;               /* if the chunk data should be skipped instead of being decoded (see phr_decode_chunked) */
     char _hex_count;
     char _state;
     uint64_t _total_read;
@@ -77,12 +384,148 @@ struct phr_chunked_decoder {
  * found, the function returns a non-negative number indicating the number of
  * octets left undecoded, that starts from the offset returned by `*bufsz`.
  * Returns -1 on error.
+ * If `discard` of the decoder is set, the chunk data is skipped without
+ * modifying the buffer, and `*bufsz` is instead set to the number of bytes
+ * being consumed, as is the case for phr_decode_chunked_spans.  This is for
+ * draining the bodies that are not used, at the cost proportional to the
+ * number of chunks rather than the size of the body.
  */
 ssize_t phr_decode_chunked(struct phr_chunked_decoder *decoder, char *buf, size_t *bufsz);
 
+/* location of the chunk data within the buffer given to phr_decode_chunked_spans */
+struct phr_chunked_span {
+    size_t off;
+    size_t len;
+};
+
+/* Same as phr_decode_chunked, but instead of rewriting the buffer, the function stores the locations of the chunk data to `spans`
+ * (up to `*num_spans` entries), setting `*num_spans` to the number of entries being used, and `*bufsz` to the number of bytes being
+ * consumed. When the spans run short, the function returns -2 (incomplete) without consuming the rest of the input; the
+ * application should call the function again, supplying the data that starts from the offset returned by `*bufsz`. If the end of
+ * the chunked-encoded data is found, the function returns the number of octets that follow the encoded data, which start from the
+ * offset returned by `*bufsz`. */
+ssize_t phr_decode_chunked_spans(struct phr_chunked_decoder *decoder, const char *buf, size_t *bufsz,
+                                 struct phr_chunked_span *spans, size_t *num_spans);
+
+/* Same as phr_decode_chunked_spans, but also returns the chunk extensions and the trailers, referring to the buffer without
+ * copying. The locations of the chunk extensions (the text after the chunk size excluding the leading whitespace, e.g.
+ * `;name=value`) are stored to `exts` (up to `*num_exts` entries), and the trailers are parsed as phr_parse_headers does and stored
+ * to `trailers` (up to `*num_trailers` entries); either can be NULL if not needed. If `trailers` is non-NULL, the trailers are
+ * consumed regardless of `consume_trailer`, and -1 is returned if they do not fit. So that they can be referred to, the chunk
+ * header lines (if `exts` is non-NULL) and the trailer section (if `trailers` is non-NULL) are consumed only when complete; when
+ * they are partial, or when `exts` runs short, the function returns -2 and the application should call the function again,
+ * supplying the data that starts from the offset returned by `*bufsz`. */
+ssize_t phr_decode_chunked_metadata(struct phr_chunked_decoder *decoder, const char *buf, size_t *bufsz,
+                                    struct phr_chunked_span *spans, size_t *num_spans, struct phr_chunked_span *exts,
+                                    size_t *num_exts, struct phr_header *trailers, size_t *num_trailers);
+
+/* Same as phr_decode_chunked, but decodes the segments in place, updating the lengths of the segments to those of the decoded data.
+ * If the end of the chunked-encoded data is found, `*iovcnt` is set to the number of segments being decoded, and the function
+ * returns the number of octets left undecoded, which start from the end of the decoded data of the last decoded segment, followed
+ * by the segments that have not been decoded. If `discard` of the decoder is set, each segment becomes empty, being located at the
+ * end of the bytes consumed from the segment. */
+ssize_t phr_decode_chunked_iov(struct phr_chunked_decoder *decoder, struct phr_iovec *iov, size_t *iovcnt);
+
 /* returns if the chunked decoder is in middle of chunked data */
 int phr_decode_chunked_is_in_data(struct phr_chunked_decoder *decoder);
 
+#define PHR_BODY_NONE 0           /* the message has no body */
+#define PHR_BODY_CONTENT_LENGTH 1 /* the body is delimited by Content-Length */
+#define PHR_BODY_CHUNKED 2        /* the body is chunked-encoded */
+#define PHR_BODY_UNTIL_CLOSE 3    /* the body is delimited by the closure of the connection */
+
+/* reads the body of a message regardless of its framing; should be initialized by one of the phr_body_reader_init functions */
+struct phr_body_reader {
+    int type;                            /* PHR_BODY_*; becomes PHR_BODY_NONE once the end of the body is found */
+    size_t bytes_left;                   /* number of bytes left in the body, if type is PHR_BODY_CONTENT_LENGTH */
+    struct phr_chunked_decoder _chunked; /* used if type is PHR_BODY_CHUNKED */
+};
+
+/* Initializes the reader for the given type of framing, using `content_length` if the type is PHR_BODY_CONTENT_LENGTH. The
+ * trailers of chunked-encoded bodies are consumed, so that the octets that follow the body can be handled as the next message. */
+void phr_body_reader_init(struct phr_body_reader *reader, int type, size_t content_length);
+
+/* Initializes the reader for the body of a request, using the framing extracted by phr_parse_request_framing. A request having
+ * neither Content-Length nor Transfer-Encoding has no body. */
+void phr_body_reader_init_request(struct phr_body_reader *reader, const struct phr_framing *framing);
+
+/* Initializes the reader for the body of a response, using the framing extracted by phr_parse_response_framing. Responses to HEAD
+ * requests and those with 1xx, 204 or 304 status have no body; otherwise, if neither chunked nor Content-Length is used, the
+ * body continues until the connection is closed. */
+void phr_body_reader_init_response(struct phr_body_reader *reader, const struct phr_framing *framing, int status,
+                                   int head_request);
+
+/* Reads the body, with the same contract as phr_decode_chunked_spans; the locations of the payload within the buffer are stored
+ * to `spans` (or the payload is skipped if `spans` is NULL), and `*bufsz` is set to the number of bytes being consumed. Returns -2
+ * if more data is needed, or -1 on error. When the end of the body is found, the function returns the number of octets that
+ * follow the body (i.e. the pipelined data), which start from the offset returned by `*bufsz`. A body delimited by the closure of
+ * the connection never ends; see phr_body_reader_eof. */
+ssize_t phr_body_reader_read(struct phr_body_reader *reader, const char *buf, size_t *bufsz, struct phr_chunked_span *spans,
+                             size_t *num_spans);
+
+/* Tells the reader that the connection has been closed. Returns 0 if the body has been read completely (i.e. the body is
+ * delimited by the closure of the connection, or has ended already), or -1 if the body has been truncated. */
+int phr_body_reader_eof(struct phr_body_reader *reader);
+
+/* Server-side connection that drives the parsing of the requests, the delimitation of their bodies and the turnover of persistent
+ * connections over a single buffer owned by the application. Should be initialized by phr_conn_init. */
+struct phr_conn {
+    char *buf;
+    size_t capacity;
+    struct phr_header *headers; /* storage for the headers of the current request */
+    size_t max_headers;
+    size_t _start;    /* offset of the first byte that has not been consumed */
+    size_t _end;      /* offset of the end of the received data */
+    size_t _last_len; /* length of the partial request head that has been checked */
+    int _state;
+    int _keep_alive;
+    int _upgrade;
+    int _discard_body;
+    struct phr_body_reader _body;
+};
+
+#define PHR_CONN_EVENT_REQUEST 0  /* a request head has been parsed */
+#define PHR_CONN_EVENT_BODY 1     /* a piece of the request body has been received */
+#define PHR_CONN_EVENT_BODY_END 2 /* the request has been received completely (reported also for requests without body) */
+#define PHR_CONN_EVENT_CLOSE 3    /* the connection should be closed, as the last request has been received */
+#define PHR_CONN_EVENT_UPGRADE 4  /* the request has switched protocols; the data that follows is left for phr_conn_pending */
+
+struct phr_conn_event {
+    struct phr_request request; /* PHR_CONN_EVENT_REQUEST */
+    int keep_alive;             /* PHR_CONN_EVENT_REQUEST: if the connection persists after the request */
+    const char *body;           /* PHR_CONN_EVENT_BODY */
+    size_t body_len;            /* PHR_CONN_EVENT_BODY */
+};
+
+/* initializes the connection, to use `buf` for receiving the data and `headers` for storing the headers of each request */
+void phr_conn_init(struct phr_conn *conn, char *buf, size_t capacity, struct phr_header *headers, size_t max_headers);
+
+/* Returns the space into which the application should receive the data, setting `*len` to its size; phr_conn_received should be
+ * called afterwards with the number of bytes that have been received. The buffer is compacted only when the data that has not
+ * been consumed (i.e. a partial message) is left at the tail and moving it to the front gains more space than is left at the
+ * tail. Returns NULL if the buffer is full (i.e. a request head does not fit). Calling this function might invalidate the
+ * pointers returned by phr_conn_next. */
+char *phr_conn_reserve(struct phr_conn *conn, size_t *len);
+
+/* notifies the connection that `len` bytes have been received into the space returned by phr_conn_reserve */
+void phr_conn_received(struct phr_conn *conn, size_t len);
+
+/* Processes the received data, returning one of PHR_CONN_EVENT_* and filling in `event`. Returns -2 if more data is needed, or -1
+ * if the request is invalid (see phr_parse_request_framing and phr_body_reader_read). The events for each request are
+ * PHR_CONN_EVENT_REQUEST, zero or more PHR_CONN_EVENT_BODY, and PHR_CONN_EVENT_BODY_END, followed by the events for the next
+ * request, or PHR_CONN_EVENT_CLOSE if the connection does not persist. After a CONNECT request or one having `Connection: upgrade`,
+ * PHR_CONN_EVENT_UPGRADE is returned instead of parsing the data that follows, which the application accepting the switch takes
+ * using phr_conn_pending; the application declining it should close the connection after sending the response. Once either
+ * PHR_CONN_EVENT_CLOSE or PHR_CONN_EVENT_UPGRADE is returned, every subsequent call returns the same. */
+int phr_conn_next(struct phr_conn *conn, struct phr_conn_event *event);
+
+/* Skips the rest of the body of the current request without reporting PHR_CONN_EVENT_BODY, so that a request being rejected can
+ * be drained at little cost while keeping the connection. */
+void phr_conn_discard_body(struct phr_conn *conn);
+
+/* returns the data that has been received but not consumed, setting `*len` to its length */
+const char *phr_conn_pending(const struct phr_conn *conn, size_t *len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2009-2014 Kazuho Oku, Tokuhiro Matsuno, Daisuke Murase,
+ *                         Shigeo Mitsunari
+ *
+ * The software is licensed under either the MIT License (below) or the Perl
+ * license.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef picohttpparser_hpp
+#define picohttpparser_hpp
+
+/* A header-only C++17 layer over the C API. The classes hold the output of the parser in fixed-size storage, and the accessors
+ * convert the pointer/length pairs to std::string_view on the fly; nothing is allocated or copied. */
+
+#include <cstddef>
+#include <optional>
+#include <string_view>
+#include "picohttpparser.h"
+
+namespace phr
+{
+
+enum class ParseStatus {
+    Complete,   /* the message head has been parsed */
+    Incomplete, /* more data is needed (-2) */
+    Error       /* the input is malformed, or has more headers than can be stored (-1) */
+};
+
+struct ParseResult {
+    ParseStatus status;
+    std::size_t consumed; /* length of the message head; zero unless complete */
+
+    static constexpr ParseResult from_c(int ret) noexcept
+    {
+        if (ret >= 0)
+            return {ParseStatus::Complete, static_cast<std::size_t>(ret)};
+        return {ret == -2 ? ParseStatus::Incomplete : ParseStatus::Error, 0};
+    }
+    constexpr bool complete() const noexcept { return status == ParseStatus::Complete; }
+    constexpr bool incomplete() const noexcept { return status == ParseStatus::Incomplete; }
+    constexpr bool error() const noexcept { return status == ParseStatus::Error; }
+    constexpr explicit operator bool() const noexcept { return complete(); }
+};
+
+/* a header; `name` is empty for the continuation lines of a multiline header */
+struct Header {
+    std::string_view name;
+    std::string_view value;
+};
+
+namespace detail
+{
+
+inline std::string_view to_view(const char *p, std::size_t len) noexcept
+{
+    return p != nullptr ? std::string_view(p, len) : std::string_view();
+}
+
+inline bool equals_ignore_case(std::string_view x, std::string_view y) noexcept
+{
+    if (x.size() != y.size())
+        return false;
+    for (std::size_t i = 0; i != x.size(); ++i) {
+        unsigned char a = static_cast<unsigned char>(x[i]), b = static_cast<unsigned char>(y[i]);
+        if (a != b && ((a | 0x20) != (b | 0x20) || static_cast<unsigned>((a | 0x20) - 'a') > 'z' - 'a'))
+            return false;
+    }
+    return true;
+}
+
+} // namespace detail
+
+/* the headers being parsed, stored in an array of `MaxHeaders` entries */
+template <std::size_t MaxHeaders> class Headers
+{
+    static_assert(MaxHeaders != 0, "MaxHeaders must be non-zero");
+
+  public:
+    class iterator
+    {
+      public:
+        explicit iterator(const phr_header *p) noexcept : p_(p) {}
+        Header operator*() const noexcept
+        {
+            return {detail::to_view(p_->name, p_->name_len), detail::to_view(p_->value, p_->value_len)};
+        }
+        iterator &operator++() noexcept
+        {
+            ++p_;
+            return *this;
+        }
+        bool operator==(const iterator &x) const noexcept { return p_ == x.p_; }
+        bool operator!=(const iterator &x) const noexcept { return p_ != x.p_; }
+
+      private:
+        const phr_header *p_;
+    };
+
+    static constexpr std::size_t capacity() noexcept { return MaxHeaders; }
+    std::size_t size() const noexcept { return num_headers_; }
+    bool empty() const noexcept { return num_headers_ == 0; }
+    Header operator[](std::size_t i) const noexcept { return *iterator(headers_ + i); }
+    iterator begin() const noexcept { return iterator(headers_); }
+    iterator end() const noexcept { return iterator(headers_ + num_headers_); }
+
+    /* returns the value of the first header with the given name (compared case-insensitively) */
+    std::optional<std::string_view> find(std::string_view name) const noexcept
+    {
+        for (std::size_t i = 0; i != num_headers_; ++i) {
+            if (detail::equals_ignore_case(detail::to_view(headers_[i].name, headers_[i].name_len), name))
+                return std::string_view(headers_[i].value, headers_[i].value_len);
+        }
+        return std::nullopt;
+    }
+
+    /* parses a header block (see phr_parse_headers) */
+    ParseResult parse(std::string_view buf, std::size_t last_len = 0) noexcept
+    {
+        num_headers_ = MaxHeaders;
+        int ret = phr_parse_headers(buf.data(), buf.size(), headers_, &num_headers_, last_len);
+        if (ret < 0)
+            num_headers_ = 0; /* the C API leaves the count of the headers parsed before stopping */
+        return ParseResult::from_c(ret);
+    }
+
+  protected:
+    phr_header headers_[MaxHeaders];
+    std::size_t num_headers_ = 0;
+};
+
+/* a request parsed by phr_parse_request */
+template <std::size_t MaxHeaders> class Request : protected Headers<MaxHeaders>
+{
+  public:
+    ParseResult parse(std::string_view buf, std::size_t last_len = 0) noexcept
+    {
+        this->num_headers_ = MaxHeaders;
+        int ret = phr_parse_request(buf.data(), buf.size(), &method_, &method_len_, &path_, &path_len_, &minor_version_,
+                                    this->headers_, &this->num_headers_, last_len);
+        if (ret < 0)
+            this->num_headers_ = 0;
+        return ParseResult::from_c(ret);
+    }
+
+    std::string_view method() const noexcept { return detail::to_view(method_, method_len_); }
+    std::string_view path() const noexcept { return detail::to_view(path_, path_len_); }
+    int minor_version() const noexcept { return minor_version_; }
+    const Headers<MaxHeaders> &headers() const noexcept { return *this; }
+
+  private:
+    const char *method_ = nullptr, *path_ = nullptr;
+    std::size_t method_len_ = 0, path_len_ = 0;
+    int minor_version_ = -1;
+};
+
+/* a response parsed by phr_parse_response */
+template <std::size_t MaxHeaders> class Response : protected Headers<MaxHeaders>
+{
+  public:
+    ParseResult parse(std::string_view buf, std::size_t last_len = 0) noexcept
+    {
+        this->num_headers_ = MaxHeaders;
+        int ret = phr_parse_response(buf.data(), buf.size(), &minor_version_, &status_, &msg_, &msg_len_, this->headers_,
+                                     &this->num_headers_, last_len);
+        if (ret < 0)
+            this->num_headers_ = 0;
+        return ParseResult::from_c(ret);
+    }
+
+    int minor_version() const noexcept { return minor_version_; }
+    int status() const noexcept { return status_; }
+    std::string_view message() const noexcept { return detail::to_view(msg_, msg_len_); }
+    const Headers<MaxHeaders> &headers() const noexcept { return *this; }
+
+  private:
+    const char *msg_ = nullptr;
+    std::size_t msg_len_ = 0;
+    int minor_version_ = -1, status_ = 0;
+};
+
+} // namespace phr
+
+#endif
@@ -25,6 +25,7 @@
  * IN THE SOFTWARE.
  */
 #include <assert.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,9 +35,35 @@
 #include "picotest/picotest.h"
 #include "picohttpparser.h"
 
+/* the policies that the parser is compiled with; the expectations that depend on them are switched using these (see `make
+ * test-strict`) */
+#if defined(PHR_STRICT) || defined(PHR_REQUIRE_CRLF)
+#define STRICT_CRLF 1
+#else
+#define STRICT_CRLF 0
+#endif
+#if defined(PHR_STRICT) || defined(PHR_NO_OBS_FOLD)
+#define STRICT_OBS_FOLD 1
+#else
+#define STRICT_OBS_FOLD 0
+#endif
+#if defined(PHR_STRICT) || defined(PHR_NO_LEADING_EMPTY_LINE)
+#define STRICT_EMPTY_LINE 1
+#else
+#define STRICT_EMPTY_LINE 0
+#endif
+
+/* a continuation line, included in the inputs only if the parser accepts obsolete line folding */
+#if STRICT_OBS_FOLD
+#define OBS_FOLD(line) ""
+#else
+#define OBS_FOLD(line) line
+#endif
+
 static int bufis(const char *s, size_t l, const char *t)
 {
-    return strlen(t) == l && memcmp(s, t, l) == 0;
+    /* `s` is NULL if nothing has been parsed */
+    return strlen(t) == l && (l == 0 || memcmp(s, t, l) == 0);
 }
 
 static char *inputbuf; /* point to the end of the buffer */
@@ -89,6 +116,7 @@ static void test_request(void)
     ok(bufis(headers[1].name, headers[1].name_len, "User-Agent"));
     ok(bufis(headers[1].value, headers[1].value_len, "\343\201\262\343/1.0"));
 
+#if !STRICT_OBS_FOLD
     PARSE("GET / HTTP/1.0\r\nfoo: \r\nfoo: b\r\n  \tc\r\n\r\n", 0, 0, "parse multiline");
     ok(num_headers == 3);
     ok(bufis(method, method_len, "GET"));
@@ -100,6 +128,9 @@ static void test_request(void)
     ok(bufis(headers[1].value, headers[1].value_len, "b"));
     ok(headers[2].name == NULL);
     ok(bufis(headers[2].value, headers[2].value_len, "  \tc"));
+#else
+    PARSE("GET / HTTP/1.0\r\nfoo: \r\nfoo: b\r\n  \tc\r\n\r\n", 0, -1, "reject multiline");
+#endif
 
     PARSE("GET / HTTP/1.0\r\nfoo : ab\r\n\r\n", 0, -1, "parse header name with trailing space");
 
@@ -157,6 +188,60 @@ static void test_request(void)
     PARSE("GET   /   HTTP/1.0\r\n\r\n", 0, 0, "accept multiple spaces between tokens");
 
 #undef PARSE
+
+    note("long tokens with an invalid char at every offset");
+    {
+        /* the tokens are long enough to run through every block size of the vectorized scanners */
+        char req[256];
+        size_t i, reqlen;
+        int fail = 0;
+#define PARSE_AT(fmt, pos, ch, exp)                                                                                                \
+    do {                                                                                                                           \
+        char token[101];                                                                                                           \
+        memset(token, 'a', 100);                                                                                                   \
+        token[100] = '\0';                                                                                                         \
+        token[pos] = ch;                                                                                                           \
+        reqlen = (size_t)sprintf(req, fmt, token);                                                                                 \
+        memcpy(inputbuf - reqlen, req, reqlen);                                                                                    \
+        num_headers = sizeof(headers) / sizeof(headers[0]);                                                                        \
+        if (phr_parse_request(inputbuf - reqlen, reqlen, &method, &method_len, &path, &path_len, &minor_version, headers,          \
+                              &num_headers, 0) != (exp == 0 ? (int)reqlen : exp))                                                  \
+            fail = 1;                                                                                                              \
+    } while (0)
+        for (i = 0; i < 100; ++i) {
+            PARSE_AT("GET / HTTP/1.1\r\nfoo: %s\r\n\r\n", i, '\001', -1);
+            PARSE_AT("GET / HTTP/1.1\r\nfoo: %s\r\n\r\n", i, '\177', -1);
+            PARSE_AT("GET / HTTP/1.1\r\nfoo: %s\r\n\r\n", i, '\t', 0);
+            PARSE_AT("GET / HTTP/1.1\r\nfoo: %s\r\n\r\n", i, '\xff', 0);
+            PARSE_AT("GET /%s HTTP/1.1\r\n\r\n", i, '\177', -1);
+            PARSE_AT("GET /%s HTTP/1.1\r\n\r\n", i, '\xff', 0);
+            PARSE_AT("GET / HTTP/1.1\r\n%s: foo\r\n\r\n", i, '{', -1);
+            PARSE_AT("GET / HTTP/1.1\r\n%s: foo\r\n\r\n", i, '|', 0);
+            PARSE_AT("%s / HTTP/1.1\r\n\r\n", i, '"', -1);
+            PARSE_AT("%s / HTTP/1.1\r\n\r\n", i, '~', 0);
+        }
+#undef PARSE_AT
+        ok(!fail);
+    }
+
+    note("every octet in long header names");
+    {
+        char req[256];
+        size_t reqlen;
+        int c, fail = 0;
+        for (c = 0; c < 256; ++c) {
+            int is_tchar = c != 0 && ((c < 0x80 && isalnum(c)) || strchr("!#$%&'*+-.^_`|~", c) != NULL), exp;
+            reqlen = (size_t)sprintf(req, "GET / HTTP/1.1\r\n%081d: foo\r\n\r\n", 0);
+            req[sizeof("GET / HTTP/1.1\r\n") - 1 + 40] = (char)c;
+            exp = is_tchar || c == ':' ? (int)reqlen : -1;
+            memcpy(inputbuf - reqlen, req, reqlen);
+            num_headers = sizeof(headers) / sizeof(headers[0]);
+            if (phr_parse_request(inputbuf - reqlen, reqlen, &method, &method_len, &path, &path_len, &minor_version, headers,
+                                  &num_headers, 0) != exp)
+                fail = 1;
+        }
+        ok(!fail);
+    }
 }
 
 static void test_response(void)
@@ -196,6 +281,7 @@ static void test_response(void)
     ok(bufis(headers[1].name, headers[1].name_len, "Cookie"));
     ok(bufis(headers[1].value, headers[1].value_len, ""));
 
+#if !STRICT_OBS_FOLD
     PARSE("HTTP/1.0 200 OK\r\nfoo: \r\nfoo: b\r\n  \tc\r\n\r\n", 0, 0, "parse multiline");
     ok(num_headers == 3);
     ok(minor_version == 0);
@@ -207,6 +293,9 @@ static void test_response(void)
     ok(bufis(headers[1].value, headers[1].value_len, "b"));
     ok(headers[2].name == NULL);
     ok(bufis(headers[2].value, headers[2].value_len, "  \tc"));
+#else
+    PARSE("HTTP/1.0 200 OK\r\nfoo: \r\nfoo: b\r\n  \tc\r\n\r\n", 0, -1, "reject multiline");
+#endif
 
     PARSE("HTTP/1.0 500 Internal Server Error\r\n\r\n", 0, 0, "internal server error");
     ok(num_headers == 0);
@@ -231,8 +320,10 @@ static void test_response(void)
     ok(msg == NULL);
     PARSE("HTTP/1.1 200 OK\r\n", 0, -2, "incomplete 10");
     ok(bufis(msg, msg_len, "OK"));
+#if !STRICT_CRLF
     PARSE("HTTP/1.1 200 OK\n", 0, -2, "incomplete 11");
     ok(bufis(msg, msg_len, "OK"));
+#endif
 
     PARSE("HTTP/1.1 200 OK\r\nA: 1\r", 0, -2, "incomplete 11");
     ok(num_headers == 0);
@@ -297,6 +388,785 @@ static void test_headers(void)
 #undef PARSE
 }
 
+static int find_headers_end_ref(const char *buf, size_t len, size_t last_len)
+{
+    size_t i = last_len < 3 ? 0 : last_len - 3;
+    int ret_cnt = 0;
+
+    while (i != len) {
+        if (buf[i] == '\r') {
+            if (++i == len)
+                return -2;
+            if (buf[i++] != '\n')
+                return -1;
+            ++ret_cnt;
+        } else if (buf[i] == '\n') {
+            ++i;
+            ++ret_cnt;
+        } else {
+            ++i;
+            ret_cnt = 0;
+        }
+        if (ret_cnt == 2)
+            return (int)i;
+    }
+    return -2;
+}
+
+static void test_find_headers_end(void)
+{
+    static const char *simple = "GET / HTTP/1.1\r\nHost: example.com\r\n\r\nbody";
+    size_t len = strlen(simple), last_len;
+    unsigned seed = 1;
+    int i, fail = 0;
+
+    ok(phr_find_headers_end(simple, len, 0) == (int)len - 4);
+    ok(phr_find_headers_end(simple, len - 5, 0) == -2);
+    ok(phr_find_headers_end("a\n\nb", 4, 0) == 3);
+    ok(phr_find_headers_end("a\r\n\nb", 5, 0) == 4);
+    ok(phr_find_headers_end("a\n\r\nb", 5, 0) == 4);
+    ok(phr_find_headers_end("a\r\n\r", 4, 0) == -2);
+    ok(phr_find_headers_end("a\r\n\rb", 5, 0) == -1);
+
+    /* compare against the byte-by-byte algorithm using inputs with sparse CR and LF, resuming from every offset */
+    for (i = 0; i != 1000; ++i) {
+        char *buf;
+        size_t j;
+        len = (size_t)i % 200 + 1;
+        buf = inputbuf - len;
+        for (j = 0; j != len; ++j) {
+            unsigned r = (seed = seed * 1103515245 + 12345) >> 16 & 63;
+            buf[j] = r < 2 ? '\r' : r < 5 ? '\n' : 'a';
+        }
+        for (last_len = 0; last_len <= len; ++last_len) {
+            if (phr_find_headers_end(buf, len, last_len) != find_headers_end_ref(buf, len, last_len))
+                fail = 1;
+        }
+    }
+    ok(!fail);
+}
+
+static void test_header_ids(void)
+{
+    struct phr_header headers[4];
+    int header_ids[4];
+    const char *method, *path;
+    size_t method_len, path_len, num_headers;
+    int minor_version;
+
+#define CHECK(name, id) ok(phr_lookup_header(name, strlen(name)) == id)
+    CHECK("host", PHR_HEADER_HOST);
+    CHECK("Host", PHR_HEADER_HOST);
+    CHECK("HOST", PHR_HEADER_HOST);
+    CHECK("Content-Length", PHR_HEADER_CONTENT_LENGTH);
+    CHECK("content-length", PHR_HEADER_CONTENT_LENGTH);
+    CHECK("Transfer-Encoding", PHR_HEADER_TRANSFER_ENCODING);
+    CHECK("Connection", PHR_HEADER_CONNECTION);
+    CHECK("TE", PHR_HEADER_TE);
+    CHECK("HTTP2-Settings", PHR_HEADER_HTTP2_SETTINGS);
+    CHECK("Access-Control-Allow-Origin", PHR_HEADER_ACCESS_CONTROL_ALLOW_ORIGIN);
+    CHECK("X-Real-IP", PHR_HEADER_X_REAL_IP);
+    CHECK("", PHR_HEADER_UNKNOWN);
+    CHECK("x", PHR_HEADER_UNKNOWN);
+    CHECK("hosts", PHR_HEADER_UNKNOWN);
+    CHECK("hast", PHR_HEADER_UNKNOWN);
+    CHECK("content_length", PHR_HEADER_UNKNOWN);
+    CHECK("content-lengtg", PHR_HEADER_UNKNOWN);
+    CHECK("X-Custom-Header", PHR_HEADER_UNKNOWN);
+#undef CHECK
+
+    num_headers = sizeof(headers) / sizeof(headers[0]);
+    ok(phr_parse_request_with_ids("GET / HTTP/1.1\r\nHost: example.com\r\nX-Foo: a\r\n b\r\ncontent-length: 0\r\n\r\n", 70, &method,
+                                  &method_len, &path, &path_len, &minor_version, headers, header_ids, &num_headers,
+                                  0) == (STRICT_OBS_FOLD ? -1 : 70));
+#if !STRICT_OBS_FOLD
+    ok(num_headers == 4);
+    ok(header_ids[0] == PHR_HEADER_HOST);
+    ok(header_ids[1] == PHR_HEADER_UNKNOWN);
+    ok(header_ids[2] == PHR_HEADER_UNKNOWN);
+    ok(header_ids[3] == PHR_HEADER_CONTENT_LENGTH);
+#endif
+
+    num_headers = sizeof(headers) / sizeof(headers[0]);
+    ok(phr_parse_headers_with_ids("Connection: close\r\n\r\n", 21, headers, header_ids, &num_headers, 0) == 21);
+    ok(num_headers == 1);
+    ok(header_ids[0] == PHR_HEADER_CONNECTION);
+}
+
+static void test_framing(void)
+{
+    struct phr_header headers[4];
+    struct phr_framing framing;
+    const char *method, *path, *msg;
+    size_t method_len, path_len, msg_len, num_headers;
+    int minor_version, status;
+
+#define PARSE(s, exp, comment)                                                                                                     \
+    do {                                                                                                                           \
+        note(comment);                                                                                                             \
+        num_headers = sizeof(headers) / sizeof(headers[0]);                                                                        \
+        ok(phr_parse_request_framing(s, strlen(s), &method, &method_len, &path, &path_len, &minor_version, headers, &num_headers,  \
+                                     &framing, 0) == (exp == 0 ? (int)strlen(s) : exp));                                           \
+    } while (0)
+
+    PARSE("GET / HTTP/1.1\r\nHost: example.com\r\n\r\n", 0, "no body");
+    ok(framing.flags == 0);
+
+    PARSE("POST / HTTP/1.1\r\ncontent-length: 12345\r\n\r\n", 0, "content-length");
+    ok(framing.flags == PHR_FRAMING_CONTENT_LENGTH);
+    ok(framing.content_length == 12345);
+
+    PARSE("POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 5, 5\r\n\r\n", 0, "identical content-lengths");
+    ok(framing.flags == PHR_FRAMING_CONTENT_LENGTH);
+    ok(framing.content_length == 5);
+
+    PARSE("POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\n", -1, "different content-lengths");
+    PARSE("POST / HTTP/1.1\r\nContent-Length: 5, 6\r\n\r\n", -1, "different content-lengths in a list");
+    PARSE("POST / HTTP/1.1\r\nContent-Length: \r\n\r\n", -1, "empty content-length");
+    PARSE("POST / HTTP/1.1\r\nContent-Length: ,\r\n\r\n", -1, "content-length without a value");
+    PARSE("POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: ,\r\n\r\n", -1, "content-length without a value after another");
+    PARSE("POST / HTTP/1.1\r\nContent-Length: +5\r\n\r\n", -1, "signed content-length");
+    PARSE("POST / HTTP/1.1\r\nContent-Length: 5 5\r\n\r\n", -1, "content-length with a space");
+    PARSE("POST / HTTP/1.1\r\nContent-Length: 5\r\n 5\r\n\r\n", -1, "folded content-length");
+    PARSE("POST / HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\n", -1, "content-length overflow");
+
+    PARSE("POST / HTTP/1.1\r\nTransfer-Encoding: gzip, Chunked\r\n\r\n", 0, "chunked");
+    ok(framing.flags == (PHR_FRAMING_TRANSFER_ENCODING | PHR_FRAMING_CHUNKED));
+
+    PARSE("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: gzip\r\n\r\n", -1, "chunked not final");
+    PARSE("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 5\r\n\r\n", -1, "both");
+    PARSE("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n chunked\r\n\r\n", -1, "folded transfer-encoding");
+    PARSE("POST / HTTP/1.1\r\nTransfer-Encoding: xchunked\r\n\r\n", -1, "similar to chunked");
+
+    PARSE("GET / HTTP/1.1\r\nConnection: Keep-Alive, Upgrade\r\nExpect: 100-Continue\r\n\r\n", 0, "connection and expect");
+    ok(framing.flags == (PHR_FRAMING_CONNECTION_KEEP_ALIVE | PHR_FRAMING_CONNECTION_UPGRADE | PHR_FRAMING_EXPECT_CONTINUE));
+
+    PARSE("GET / HTTP/1.1\r\nConnection: foo,close\r\n\r\n", 0, "connection close");
+    ok(framing.flags == PHR_FRAMING_CONNECTION_CLOSE);
+
+#undef PARSE
+
+    num_headers = sizeof(headers) / sizeof(headers[0]);
+    ok(phr_parse_response_framing("HTTP/1.1 200 OK\r\nTransfer-Encoding: gzip\r\n\r\n", 44, &minor_version, &status, &msg, &msg_len,
+                                  headers, &num_headers, &framing, 0) == 44);
+    ok(framing.flags == PHR_FRAMING_TRANSFER_ENCODING);
+}
+
+static void test_batch(void)
+{
+#define REQ_A "GET /a HTTP/1.1\r\nHost: example.com\r\n\r\n"
+#define REQ_B "GET /b HTTP/1.1\r\nHost: example.com\r\nCookie: hoge\r\n\r\n"
+#define REQ_C "POST /c HTTP/1.1\r\nContent-Length: 3\r\n\r\n"
+#define REQ_INVALID "GET /b HTTP/1.1\r\nHo\7fst: example.com\r\n\r\n"
+    static const char *pipelined = REQ_A REQ_B REQ_C "abc" REQ_A;
+    struct phr_request requests[4];
+    struct phr_header headers[4];
+    size_t num_requests, num_headers, first_len = strlen(REQ_A), second_len = strlen(REQ_B), third_len = strlen(REQ_C);
+
+#define PARSE(s, len, max_requests, max_headers, exp)                                                                              \
+    do {                                                                                                                           \
+        num_requests = max_requests;                                                                                               \
+        num_headers = max_headers;                                                                                                 \
+        ok(phr_parse_requests_batch(s, len, requests, &num_requests, headers, &num_headers) == exp);                               \
+    } while (0)
+
+    note("stop after a request having a body");
+    PARSE(pipelined, strlen(pipelined), 4, 4, (int)(first_len + second_len + third_len));
+    ok(num_requests == 3);
+    ok(num_headers == 4);
+    ok(bufis(requests[0].path, requests[0].path_len, "/a"));
+    ok(requests[0].headers == headers);
+    ok(requests[0].num_headers == 1);
+    ok(bufis(requests[1].path, requests[1].path_len, "/b"));
+    ok(requests[1].headers == headers + 1);
+    ok(requests[1].num_headers == 2);
+    ok(bufis(requests[1].headers[1].value, requests[1].headers[1].value_len, "hoge"));
+    ok(bufis(requests[2].method, requests[2].method_len, "POST"));
+    ok(requests[2].framing.content_length == 3);
+
+    note("stop at a partial request");
+    PARSE(pipelined, first_len + second_len - 1, 4, 4, (int)first_len);
+    ok(num_requests == 1);
+
+    note("stop when the arrays are full");
+    PARSE(pipelined, strlen(pipelined), 1, 4, (int)first_len);
+    ok(num_requests == 1);
+    PARSE(pipelined, strlen(pipelined), 4, 2, (int)first_len);
+    ok(num_requests == 1);
+    ok(num_headers == 1);
+
+    note("errors");
+    PARSE(pipelined, first_len - 1, 4, 4, -2);
+    ok(num_requests == 0);
+    PARSE(REQ_A REQ_INVALID, strlen(REQ_A REQ_INVALID), 4, 4, (int)first_len);
+    ok(num_requests == 1);
+    PARSE(REQ_INVALID, strlen(REQ_INVALID), 4, 4, -1);
+
+#undef PARSE
+#undef REQ_A
+#undef REQ_B
+#undef REQ_C
+#undef REQ_INVALID
+}
+
+static void test_compact(void)
+{
+    static const char *req = "GET / HTTP/1.1\r\nHost: example.com\r\nX-Foo: a\r\n" OBS_FOLD(" b\r\n") "Cookie: \r\n\r\n";
+    struct phr_header headers[4];
+    struct phr_header_compact compact[4];
+    const char *method, *path, *msg;
+    size_t method_len, path_len, msg_len, num_headers, num_compact, i;
+    int minor_version, status, fail = 0;
+    char *buf;
+
+    ok(sizeof(struct phr_header_compact) == 12);
+
+    num_headers = sizeof(headers) / sizeof(headers[0]);
+    ok(phr_parse_request(req, strlen(req), &method, &method_len, &path, &path_len, &minor_version, headers, &num_headers, 0) ==
+       (int)strlen(req));
+    num_compact = sizeof(compact) / sizeof(compact[0]);
+    ok(phr_parse_request_compact(req, strlen(req), &method, &method_len, &path, &path_len, &minor_version, compact, &num_compact,
+                                 0) == (int)strlen(req));
+    ok(num_compact == num_headers);
+    for (i = 0; i != num_headers; ++i) {
+        if (headers[i].name != NULL ? !(compact[i].name_off == headers[i].name - req && compact[i].name_len == headers[i].name_len)
+                                    : compact[i].name_len != 0)
+            fail = 1;
+        if (compact[i].value_off != headers[i].value - req || compact[i].value_len != headers[i].value_len)
+            fail = 1;
+    }
+    ok(!fail);
+
+    num_compact = sizeof(compact) / sizeof(compact[0]);
+    ok(phr_parse_response_compact("HTTP/1.1 200 OK\r\nA: b\r\n\r\n", 25, &minor_version, &status, &msg, &msg_len, compact,
+                                  &num_compact, 0) == 25);
+    ok(num_compact == 1);
+    ok(compact[0].name_off == 17 && compact[0].name_len == 1);
+    ok(compact[0].value_off == 20 && compact[0].value_len == 1);
+
+    num_compact = sizeof(compact) / sizeof(compact[0]);
+    ok(phr_parse_headers_compact("A: b\r\n\r", 7, compact, &num_compact, 0) == -2);
+
+    /* values longer than 65535 bytes cannot be represented */
+    buf = malloc(70000);
+    memcpy(buf, "A: ", 3);
+    memset(buf + 3, 'a', 70000 - 7);
+    memcpy(buf + 70000 - 4, "\r\n\r\n", 4);
+    num_compact = sizeof(compact) / sizeof(compact[0]);
+    ok(phr_parse_headers_compact(buf, 70000, compact, &num_compact, 0) == -1);
+    num_headers = sizeof(headers) / sizeof(headers[0]);
+    ok(phr_parse_headers(buf, 70000, headers, &num_headers, 0) == 70000);
+    free(buf);
+}
+
+static void test_lazy(void)
+{
+    static const char *req = "GET / HTTP/1.1\r\nHost: example.com\r\nX-Foo: a\r\n b\r\nX-Bad: \001\r\n\r\n";
+    struct phr_lazy_headers lazy;
+    struct phr_header header, headers[4];
+    const char *method, *path, *msg;
+    size_t method_len, path_len, msg_len, num_headers, cursor = 0, len = strlen(req);
+    int minor_version, status;
+
+    /* malformed headers are not detected until they are accessed */
+    ok(phr_parse_request_lazy(req, len, &method, &method_len, &path, &path_len, &minor_version, &lazy, 0) == (int)len);
+    ok(bufis(method, method_len, "GET"));
+    ok(bufis(path, path_len, "/"));
+    ok(phr_lazy_next_header(&lazy, &cursor, &header) == 1);
+    ok(bufis(header.name, header.name_len, "Host"));
+    ok(bufis(header.value, header.value_len, "example.com"));
+    ok(phr_lazy_next_header(&lazy, &cursor, &header) == 1);
+    ok(bufis(header.name, header.name_len, "X-Foo"));
+#if !STRICT_OBS_FOLD
+    ok(phr_lazy_next_header(&lazy, &cursor, &header) == 1);
+    ok(header.name == NULL);
+    ok(bufis(header.value, header.value_len, " b"));
+#endif
+    ok(phr_lazy_next_header(&lazy, &cursor, &header) == -1);
+    num_headers = 4;
+    ok(phr_lazy_split_headers(&lazy, headers, &num_headers) == -1);
+
+    ok(phr_parse_request_lazy(req, len - 1, &method, &method_len, &path, &path_len, &minor_version, &lazy, 0) == -2);
+    ok(phr_parse_request_lazy(req, len, &method, &method_len, &path, &path_len, &minor_version, &lazy, len - 1) == (int)len);
+    ok(phr_parse_request_lazy("GET / HTTP/1.1\r\nA: b\r\r\n", 23, &method, &method_len, &path, &path_len, &minor_version, &lazy,
+                              0) == -1);
+    ok(phr_parse_request_lazy("GET / HTTP/1.1\r\n\r\n", 18, &method, &method_len, &path, &path_len, &minor_version, &lazy, 0) ==
+       18);
+    cursor = 0;
+    ok(phr_lazy_next_header(&lazy, &cursor, &header) == 0);
+    num_headers = 4;
+    ok(phr_lazy_split_headers(&lazy, headers, &num_headers) == 0);
+    ok(num_headers == 0);
+
+#if !STRICT_CRLF
+    ok(phr_parse_response_lazy("HTTP/1.1 200 OK\nA: b\nC: d\n\n", 27, &minor_version, &status, &msg, &msg_len, &lazy, 0) == 27);
+    ok(status == 200);
+    ok(bufis(msg, msg_len, "OK"));
+    num_headers = 4;
+    ok(phr_lazy_split_headers(&lazy, headers, &num_headers) == 0);
+    ok(num_headers == 2);
+    ok(bufis(headers[1].name, headers[1].name_len, "C"));
+    ok(bufis(headers[1].value, headers[1].value_len, "d"));
+    num_headers = 1;
+    ok(phr_lazy_split_headers(&lazy, headers, &num_headers) == -1);
+#endif
+
+    /* the end of the header block found by the slowloris check is reused */
+    ok(phr_parse_response_lazy("HTTP/1.1 200 OK\r\nA: b\r\nC: d\r\n\r\n", 31, &minor_version, &status, &msg, &msg_len, &lazy,
+                               30) == 31);
+    num_headers = 4;
+    ok(phr_lazy_split_headers(&lazy, headers, &num_headers) == 0);
+    ok(num_headers == 2);
+    ok(bufis(headers[0].name, headers[0].name_len, "A"));
+    ok(bufis(headers[1].value, headers[1].value_len, "d"));
+    ok(phr_parse_request_lazy("GET / HTTP/1.1\r\n\r\n", 18, &method, &method_len, &path, &path_len, &minor_version, &lazy, 17) ==
+       18);
+    num_headers = 4;
+    ok(phr_lazy_split_headers(&lazy, headers, &num_headers) == 0);
+    ok(num_headers == 0);
+}
+
+static int count_header(void *cb_data, const struct phr_header *header)
+{
+    (void)header;
+    ++*(size_t *)cb_data;
+    return PHR_CB_CONTINUE;
+}
+
+static void test_selective(void)
+{
+    static const char *req = "GET / HTTP/1.1\r\nUser-Agent: \001\r\nHost: example.com\r\nX-Foo: a\r\n b\r\nCOOKIE: c=d \r\n"
+                             "Accept: */*\r\n\r\n";
+    static const char *const wanted[] = {"host", "cookie", "x-foo", "x_bar"};
+    struct phr_header headers[4];
+    const char *method, *path, *msg;
+    size_t method_len, path_len, msg_len, num_headers, len = strlen(req);
+    int minor_version, status;
+
+#define PARSE(s, len, n, last_len)                                                                                                 \
+    (num_headers = n, phr_parse_headers_selective(s, len, wanted, 4, headers, &num_headers, last_len))
+
+#if !STRICT_OBS_FOLD
+    num_headers = 4;
+    ok(phr_parse_request_selective(req, len, &method, &method_len, &path, &path_len, &minor_version, wanted, 4, headers,
+                                   &num_headers, 0) == (int)len);
+    ok(bufis(method, method_len, "GET"));
+    ok(num_headers == 4);
+    ok(bufis(headers[0].name, headers[0].name_len, "Host"));
+    ok(bufis(headers[0].value, headers[0].value_len, "example.com"));
+    ok(bufis(headers[1].name, headers[1].name_len, "X-Foo"));
+    ok(headers[2].name == NULL);
+    ok(bufis(headers[2].value, headers[2].value_len, " b"));
+    ok(bufis(headers[3].name, headers[3].name_len, "COOKIE"));
+    ok(bufis(headers[3].value, headers[3].value_len, "c=d"));
+    num_headers = 3;
+    ok(phr_parse_request_selective(req, len, &method, &method_len, &path, &path_len, &minor_version, wanted, 4, headers,
+                                   &num_headers, 0) == -1);
+    num_headers = 4;
+    ok(phr_parse_request_selective(req, len - 1, &method, &method_len, &path, &path_len, &minor_version, wanted, 4, headers,
+                                   &num_headers, 0) == -2);
+#else
+    num_headers = 4;
+    ok(phr_parse_request_selective(req, len, &method, &method_len, &path, &path_len, &minor_version, wanted, 4, headers,
+                                   &num_headers, 0) == -1);
+#endif
+
+    num_headers = 4;
+    ok(phr_parse_response_selective("HTTP/1.1 200 OK\r\nA: b\r\nx_bar: c\r\n\r\n", 35, &minor_version, &status, &msg, &msg_len,
+                                    wanted, 4, headers, &num_headers, 0) == 35);
+    ok(num_headers == 1);
+    ok(bufis(headers[0].name, headers[0].name_len, "x_bar"));
+
+#if !STRICT_CRLF
+    ok(PARSE("A: b\nHost: c\n\n", 14, 4, 0) == 14);
+    ok(num_headers == 1);
+#endif
+    ok(PARSE("A: b\r\nHost: c\r\n\r\n", 17, 4, 14) == 17);
+    ok(PARSE("A: b\r\nHost: c\r\n\r", 16, 4, 0) == -2);
+    ok(PARSE("A: b\r\nHost: c\r\n\r", 16, 4, 15) == -2);
+    ok(PARSE("A: b\r\nHos", 9, 4, 0) == -2);
+    ok(PARSE("A: b\r\nHost\r\n\r\n", 14, 4, 0) == -1);  /* no colon */
+    ok(PARSE("Host\r\nA: b\r\n\r\n", 14, 4, 0) == -1);  /* ditto */
+    ok(PARSE("Host: \001\r\n\r\n", 11, 4, 0) == -1); /* the wanted headers are validated */
+    ok(PARSE(" b\r\n\r\n", 6, 4, 0) == -1);           /* continuation line at the beginning */
+    /* the names of the headers being skipped are validated as well, as phr_parse_headers does */
+    ok(PARSE("Content-Length : 10\r\n\r\n", 23, 4, 0) == -1);
+    ok(PARSE("A\tB: c\r\n\r\n", 10, 4, 0) == -1);
+    ok(PARSE("A\001: c\r\n\r\n", 9, 4, 0) == -1);
+    ok(PARSE(": c\r\n\r\n", 7, 4, 0) == -1);
+    ok(PARSE("A(: c\r\n\r\n", 9, 4, 0) == -1);
+    ok(PARSE("hosts: a\r\nhos: b\r\n\r\n", 20, 4, 0) == 20);
+    ok(num_headers == 0);
+    /* the values of the wanted headers are parsed from the colon, skipping the whitespace around them */
+    ok(PARSE("Host:\t c \r\n\r\n", 13, 4, 0) == 13);
+    ok(num_headers == 1);
+    ok(bufis(headers[0].value, headers[0].value_len, "c"));
+    /* the values of the headers being skipped are not validated */
+    ok(PARSE("X: a\rb\001\r\n\r\n", 11, 4, 0) == 11);
+
+#undef PARSE
+
+    /* the wanted names are not read beyond their NULs, even if the name being compared contains a NUL */
+    {
+        char *host = strdup("host");
+        const char *const heap_wanted[] = {host};
+        num_headers = 4;
+        ok(phr_parse_headers_selective("host\0x: a\r\n\r\n", 13, heap_wanted, 1, headers, &num_headers, 0) == -1);
+        num_headers = 4;
+        ok(phr_parse_headers_selective("hostx: a\r\n\r\n", 12, heap_wanted, 1, headers, &num_headers, 0) == 12);
+        ok(num_headers == 0);
+        free(host);
+    }
+}
+
+struct collect_headers {
+    struct phr_header headers[4];
+    size_t num_headers;
+    size_t limit; /* number of headers to be collected before returning `action` */
+    int action;
+};
+
+static int collect_header(void *cb_data, const struct phr_header *header)
+{
+    struct collect_headers *c = cb_data;
+
+    if (c->num_headers == c->limit)
+        return c->action;
+    c->headers[c->num_headers++] = *header;
+    return PHR_CB_CONTINUE;
+}
+
+static void test_callback(void)
+{
+    static const char *req = "GET / HTTP/1.1\r\nHost: example.com\r\nX-Foo: a\r\n b\r\nCookie: \r\n\r\n";
+    struct collect_headers c = {{{NULL}}, 0, 4, PHR_CB_STOP};
+    const char *method, *path, *msg;
+    size_t method_len, path_len, msg_len, len = strlen(req), i;
+    int minor_version, status;
+    char *buf;
+
+#if !STRICT_OBS_FOLD
+    ok(phr_parse_request_cb(req, len, &method, &method_len, &path, &path_len, &minor_version, collect_header, &c, 0) == (int)len);
+    ok(bufis(method, method_len, "GET"));
+    ok(bufis(path, path_len, "/"));
+    ok(c.num_headers == 4);
+    ok(bufis(c.headers[0].name, c.headers[0].name_len, "Host"));
+    ok(bufis(c.headers[0].value, c.headers[0].value_len, "example.com"));
+    ok(bufis(c.headers[1].name, c.headers[1].name_len, "X-Foo"));
+    ok(c.headers[2].name == NULL);
+    ok(bufis(c.headers[2].value, c.headers[2].value_len, " b"));
+    ok(bufis(c.headers[3].name, c.headers[3].name_len, "Cookie"));
+    ok(bufis(c.headers[3].value, c.headers[3].value_len, ""));
+#else
+    /* the headers preceding the continuation line are reported */
+    ok(phr_parse_request_cb(req, len, &method, &method_len, &path, &path_len, &minor_version, collect_header, &c, 0) == -1);
+    ok(c.num_headers == 2);
+#endif
+
+    /* stop after the first header */
+    c.num_headers = 0;
+    c.limit = 1;
+    ok(phr_parse_request_cb(req, len, &method, &method_len, &path, &path_len, &minor_version, collect_header, &c, 0) == -3);
+    ok(c.num_headers == 1);
+
+    /* skip the rest; the remaining lines are not validated */
+    c.num_headers = 0;
+    c.action = PHR_CB_SKIP;
+    ok(phr_parse_request_cb(req, len, &method, &method_len, &path, &path_len, &minor_version, collect_header, &c, 0) == (int)len);
+    ok(c.num_headers == 1);
+    c.num_headers = 0;
+    ok(phr_parse_headers_cb("A: b\r\n\r\n", 8, collect_header, &c, 0) == 8);
+#if !STRICT_CRLF
+    c.num_headers = 0;
+    ok(phr_parse_headers_cb("A: b\nB: c\nC\001: d\n\n", 17, collect_header, &c, 0) == 17);
+#endif
+    c.num_headers = 0;
+    ok(phr_parse_headers_cb("A: b\r\nC: d\r\n", 12, collect_header, &c, 0) == -2);
+    c.num_headers = 0;
+    ok(phr_parse_headers_cb("A: b\r\nC: d\r\n\rX", 14, collect_header, &c, 0) == -1);
+    c.num_headers = 0;
+    c.action = PHR_CB_STOP;
+    ok(phr_parse_headers_cb("A: b\r\n\001", 7, collect_header, &c, 0) == -1);
+
+    c.num_headers = 0;
+    c.limit = 4;
+    ok(phr_parse_response_cb("HTTP/1.1 200 OK\r\nA: b\r\n\r", 24, &minor_version, &status, &msg, &msg_len, collect_header, &c, 0) ==
+       -2);
+    c.num_headers = 0;
+    ok(phr_parse_response_cb("HTTP/1.1 200 OK\r\nA: b\r\n\r\n", 25, &minor_version, &status, &msg, &msg_len, collect_header, &c,
+                             24) == 25);
+    ok(status == 200);
+    ok(c.num_headers == 1);
+
+    /* the number of headers is not limited */
+    buf = malloc(1000 * 6 + 2);
+    for (i = 0; i != 1000; ++i)
+        memcpy(buf + i * 6, "A: b\r\n", 6);
+    memcpy(buf + 6000, "\r\n", 2);
+    c.num_headers = 0;
+    ok(phr_parse_headers_cb(buf, 6002, count_header, &c.num_headers, 0) == 6002);
+    ok(c.num_headers == 1000);
+    free(buf);
+}
+
+static void test_iov(void)
+{
+    static const char *req = "GET /hoge HTTP/1.1\r\nHost: example.com\r\nCookie: \r\nX-Foo: a\r\n" OBS_FOLD(" b\r\n") "\r\n";
+    static const char *res = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n";
+    char buf[256], scratch[256];
+    struct phr_iovec iov[3];
+    struct phr_header headers[4];
+    const char *method, *path, *msg;
+    size_t method_len, path_len, msg_len, num_headers, split1, split2;
+    int minor_version, status, fail = 0;
+
+    strcpy(buf, req);
+
+    /* split the request at every position into three segments */
+    for (split1 = 0; split1 <= strlen(req); ++split1) {
+        for (split2 = split1; split2 <= strlen(req); ++split2) {
+            iov[0].base = buf;
+            iov[0].len = split1;
+            iov[1].base = buf + split1;
+            iov[1].len = split2 - split1;
+            iov[2].base = buf + split2;
+            iov[2].len = strlen(req) - split2;
+            num_headers = sizeof(headers) / sizeof(headers[0]);
+            if (phr_parse_request_iov(iov, 3, scratch, sizeof(scratch), &method, &method_len, &path, &path_len, &minor_version,
+                                      headers, &num_headers) != (int)strlen(req) ||
+                !bufis(method, method_len, "GET") || !bufis(path, path_len, "/hoge") || minor_version != 1 ||
+                num_headers != 4 - STRICT_OBS_FOLD || !bufis(headers[0].name, headers[0].name_len, "Host") ||
+                !bufis(headers[0].value, headers[0].value_len, "example.com") ||
+                !bufis(headers[1].name, headers[1].name_len, "Cookie") || !bufis(headers[1].value, headers[1].value_len, "") ||
+                !bufis(headers[2].name, headers[2].name_len, "X-Foo") || !bufis(headers[2].value, headers[2].value_len, "a") ||
+                (!STRICT_OBS_FOLD && (headers[3].name != NULL || !bufis(headers[3].value, headers[3].value_len, " b"))))
+                fail = 1;
+            /* partial */
+            if (iov[2].len != 0) {
+                --iov[2].len;
+                num_headers = sizeof(headers) / sizeof(headers[0]);
+                if (phr_parse_request_iov(iov, 3, scratch, sizeof(scratch), &method, &method_len, &path, &path_len, &minor_version,
+                                          headers, &num_headers) != -2)
+                    fail = 1;
+            }
+        }
+    }
+    ok(!fail);
+
+    note("lines residing within a segment are not copied");
+    iov[0].base = buf;
+    iov[0].len = 20;
+    iov[1].base = buf + 20;
+    iov[1].len = strlen(req) - 20;
+    num_headers = sizeof(headers) / sizeof(headers[0]);
+    ok(phr_parse_request_iov(iov, 2, NULL, 0, &method, &method_len, &path, &path_len, &minor_version, headers, &num_headers) ==
+       (int)strlen(req));
+    ok(headers[0].name == buf + 20);
+    iov[0].len = 21;
+    iov[1].base = buf + 21;
+    iov[1].len = strlen(req) - 21;
+    num_headers = sizeof(headers) / sizeof(headers[0]);
+    ok(phr_parse_request_iov(iov, 2, NULL, 0, &method, &method_len, &path, &path_len, &minor_version, headers, &num_headers) == -1);
+
+    note("response");
+    strcpy(buf, res);
+    iov[0].base = buf;
+    iov[0].len = 10;
+    iov[1].base = buf + 10;
+    iov[1].len = strlen(res) - 10;
+    num_headers = sizeof(headers) / sizeof(headers[0]);
+    ok(phr_parse_response_iov(iov, 2, scratch, sizeof(scratch), &minor_version, &status, &msg, &msg_len, headers, &num_headers) ==
+       (int)strlen(res));
+    ok(status == 200);
+    ok(bufis(msg, msg_len, "OK"));
+    ok(num_headers == 1);
+    ok(bufis(headers[0].value, headers[0].value_len, "5"));
+
+    note("headers");
+    num_headers = sizeof(headers) / sizeof(headers[0]);
+    iov[0].base = buf + 17;
+    iov[0].len = 5;
+    iov[1].base = buf + 22;
+    iov[1].len = strlen(res) - 22;
+    ok(phr_parse_headers_iov(iov, 2, scratch, sizeof(scratch), headers, &num_headers) == (int)strlen(res) - 17);
+    ok(num_headers == 1);
+    ok(bufis(headers[0].name, headers[0].name_len, "Content-Length"));
+
+    note("errors");
+    strcpy(buf, "GET / HTTP/1.1\r\nHo\7fst: a\r\n\r\n");
+    iov[0].base = buf;
+    iov[0].len = 18;
+    iov[1].base = buf + 18;
+    iov[1].len = strlen(buf) - 18;
+    num_headers = sizeof(headers) / sizeof(headers[0]);
+    ok(phr_parse_request_iov(iov, 2, scratch, sizeof(scratch), &method, &method_len, &path, &path_len, &minor_version, headers,
+                             &num_headers) == -1);
+    strcpy(buf, "GET / HTTP/1\r\n\r\n");
+    iov[0].len = strlen(buf);
+    num_headers = sizeof(headers) / sizeof(headers[0]);
+    ok(phr_parse_request_iov(iov, 1, scratch, sizeof(scratch), &method, &method_len, &path, &path_len, &minor_version, headers,
+                             &num_headers) == -1);
+
+    note("chunked");
+    {
+        struct phr_chunked_decoder dec = {0};
+        size_t iovcnt = 3;
+        dec.consume_trailer = 1;
+        strcpy(buf, "3\r\nabc\r\n2\r\nde\r\n0\r\n\r\nGET");
+        iov[0].base = buf;
+        iov[0].len = 5;
+        iov[1].base = buf + 5;
+        iov[1].len = 15;
+        iov[2].base = buf + 20;
+        iov[2].len = strlen(buf) - 20;
+        ok(phr_decode_chunked_iov(&dec, iov, &iovcnt) == 3);
+        ok(iovcnt == 2);
+        ok(bufis(iov[0].base, iov[0].len, "ab"));
+        ok(bufis(iov[1].base, iov[1].len, "cde"));
+        ok(bufis(iov[2].base, iov[2].len, "GET"));
+    }
+}
+
+/* tests if the headers point to the same offsets of the respective buffers */
+static int headers_are(const struct phr_header *x, const char *xbase, const struct phr_header *y, const char *ybase, size_t n)
+{
+    size_t i;
+    for (i = 0; i != n; ++i) {
+        if ((x[i].name == NULL ? y[i].name != NULL : x[i].name - xbase != y[i].name - ybase) || x[i].name_len != y[i].name_len ||
+            x[i].value - xbase != y[i].value - ybase || x[i].value_len != y[i].value_len)
+            return 0;
+    }
+    return 1;
+}
+
+static void test_incremental(void)
+{
+    static const char *req =
+        "GET /hoge HTTP/1.1\r\nHost: example.com\r\nCookie: a=b\r\n" OBS_FOLD("  c=d\r\n") "User-Agent: \343\201\262\r\n\r\n";
+    static const char *res = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nX-Foo: \r\n" OBS_FOLD("\tbar\r\n") "\r\n";
+    struct phr_parse_state state;
+    struct phr_header headers[4], expected_headers[4];
+    size_t len, step, num_headers, expected_num_headers;
+    const char *method, *path, *msg, *expected_method, *expected_path, *expected_msg;
+    size_t method_len, path_len, msg_len, expected_method_len, expected_path_len, expected_msg_len;
+    int minor_version, status, expected_minor_version, expected_status, ret, fail;
+
+    expected_num_headers = 4;
+    ok(phr_parse_request(req, strlen(req), &expected_method, &expected_method_len, &expected_path, &expected_path_len,
+                         &expected_minor_version, expected_headers, &expected_num_headers, 0) == (int)strlen(req));
+
+    /* feed the request by every step size, checking that the result is identical to that of the non-incremental function */
+    for (step = 1; step <= strlen(req); ++step) {
+        char *buf = inputbuf - strlen(req);
+        memset(&state, 0, sizeof(state));
+        fail = 0;
+        for (len = 0;;) {
+            len = len + step < strlen(req) ? len + step : strlen(req);
+            memcpy(buf, req, len);
+            num_headers = sizeof(headers) / sizeof(headers[0]);
+            ret = phr_parse_request_incremental(&state, buf, len, &method, &method_len, &path, &path_len, &minor_version, headers,
+                                                &num_headers);
+            if (len != strlen(req)) {
+                if (ret != -2)
+                    fail = 1;
+                continue;
+            }
+            if (ret != (int)len || num_headers != expected_num_headers || minor_version != expected_minor_version ||
+                !(method - buf == expected_method - req && method_len == expected_method_len) ||
+                !(path - buf == expected_path - req && path_len == expected_path_len))
+                fail = 1;
+            if (!headers_are(headers, buf, expected_headers, req, expected_num_headers))
+                fail = 1;
+            break;
+        }
+        if (fail)
+            break;
+    }
+    ok(!fail);
+
+    /* resume on a buffer being moved, with the old one freed, as is the case when the buffer is grown by realloc; the request line
+     * is parsed again, and therefore its values need not be retained */
+    {
+        size_t partial = strstr(req, "Cookie") + 3 - req;
+        char *oldbuf = malloc(partial), *buf = malloc(strlen(req));
+        memcpy(oldbuf, req, partial);
+        memset(&state, 0, sizeof(state));
+        num_headers = sizeof(headers) / sizeof(headers[0]);
+        ok(phr_parse_request_incremental(&state, oldbuf, partial, &method, &method_len, &path, &path_len, &minor_version, headers,
+                                         &num_headers) == -2);
+        ok(num_headers == 1);
+        memcpy(buf, oldbuf, partial);
+        memset(oldbuf, '-', partial);
+        free(oldbuf);
+        memcpy(buf + partial, req + partial, strlen(req) - partial);
+        method = path = NULL;
+        num_headers = sizeof(headers) / sizeof(headers[0]);
+        ok(phr_parse_request_incremental(&state, buf, strlen(req), &method, &method_len, &path, &path_len, &minor_version, headers,
+                                         &num_headers) == (int)strlen(req));
+        ok(num_headers == expected_num_headers);
+        ok(method == buf + (expected_method - req) && method_len == expected_method_len);
+        ok(path == buf + (expected_path - req) && path_len == expected_path_len);
+        ok(headers_are(headers, buf, expected_headers, req, expected_num_headers));
+        ok(bufis(method, method_len, "GET"));
+        ok(bufis(headers[0].name, headers[0].name_len, "Host"));
+        free(buf);
+    }
+
+    /* same for the response */
+    expected_num_headers = 4;
+    ok(phr_parse_response(res, strlen(res), &expected_minor_version, &expected_status, &expected_msg, &expected_msg_len,
+                          expected_headers, &expected_num_headers, 0) == (int)strlen(res));
+    for (step = 1; step <= strlen(res); ++step) {
+        char *buf = inputbuf - strlen(res);
+        memset(&state, 0, sizeof(state));
+        fail = 0;
+        for (len = 0;;) {
+            len = len + step < strlen(res) ? len + step : strlen(res);
+            memcpy(buf, res, len);
+            num_headers = sizeof(headers) / sizeof(headers[0]);
+            ret = phr_parse_response_incremental(&state, buf, len, &minor_version, &status, &msg, &msg_len, headers, &num_headers);
+            if (len != strlen(res)) {
+                if (ret != -2)
+                    fail = 1;
+                continue;
+            }
+            if (ret != (int)len || num_headers != expected_num_headers || minor_version != expected_minor_version ||
+                status != expected_status || !(msg - buf == expected_msg - res && msg_len == expected_msg_len))
+                fail = 1;
+            if (!headers_are(headers, buf, expected_headers, res, expected_num_headers))
+                fail = 1;
+            break;
+        }
+        if (fail)
+            break;
+    }
+    ok(!fail);
+
+    /* headers found before the input became incomplete are reported */
+    memset(&state, 0, sizeof(state));
+    num_headers = sizeof(headers) / sizeof(headers[0]);
+    ok(phr_parse_headers_incremental(&state, "Host: example.com\r\nCookie: ", 27, headers, &num_headers) == -2);
+    ok(num_headers == 1);
+    ok(bufis(headers[0].name, headers[0].name_len, "Host"));
+    num_headers = sizeof(headers) / sizeof(headers[0]);
+    ok(phr_parse_headers_incremental(&state, "Host: example.com\r\nCookie: \r\n\r\n", 31, headers, &num_headers) == 31);
+    ok(num_headers == 2);
+    ok(bufis(headers[1].name, headers[1].name_len, "Cookie"));
+    ok(bufis(headers[1].value, headers[1].value_len, ""));
+
+    /* errors after resumption */
+    memset(&state, 0, sizeof(state));
+    num_headers = sizeof(headers) / sizeof(headers[0]);
+    ok(phr_parse_headers_incremental(&state, "Host: example.com\r\n", 19, headers, &num_headers) == -2);
+    num_headers = sizeof(headers) / sizeof(headers[0]);
+    ok(phr_parse_headers_incremental(&state, "Host: example.com\r\nX\7f: \r\n\r\n", 27, headers, &num_headers) == -1);
+    memset(&state, 0, sizeof(state));
+    num_headers = 1;
+    ok(phr_parse_headers_incremental(&state, "A: 1\r\n", 6, headers, &num_headers) == -2);
+    num_headers = 1;
+    ok(phr_parse_headers_incremental(&state, "A: 1\r\nB: 2\r\n\r\n", 14, headers, &num_headers) == -1);
+}
+
 static void test_chunked_at_once(int line, int consume_trailer, const char *encoded, const char *decoded, ssize_t expected)
 {
     struct phr_chunked_decoder dec = {0};
@@ -365,6 +1235,137 @@ cleanup:
     free(buf);
 }
 
+static void test_chunked_spans(int line, int consume_trailer, const char *encoded, const char *decoded, ssize_t expected)
+{
+    struct phr_chunked_decoder dec = {0};
+    struct phr_chunked_span span;
+    char *buf = malloc(strlen(encoded) + 1);
+    size_t off = 0, decoded_len = 0, bufsz, num_spans;
+    ssize_t ret;
+
+    dec.consume_trailer = consume_trailer;
+
+    note("testing spans, source at line %d", line);
+
+    /* decode using one span at a time, so that the function returns every time it finds chunk data */
+    do {
+        bufsz = strlen(encoded) - off;
+        num_spans = 1;
+        ret = phr_decode_chunked_spans(&dec, encoded + off, &bufsz, &span, &num_spans);
+        if (num_spans != 0) {
+            memcpy(buf + decoded_len, encoded + off + span.off, span.len);
+            decoded_len += span.len;
+        }
+        off += bufsz;
+    } while (ret == -2 && off != strlen(encoded));
+    ok(ret == expected);
+    ok(bufis(buf, decoded_len, decoded));
+    if (expected >= 0)
+        ok(off + expected == strlen(encoded));
+
+    free(buf);
+}
+
+static void test_chunked_discard(int line, int consume_trailer, const char *encoded, const char *decoded, ssize_t expected)
+{
+    struct phr_chunked_decoder dec = {0};
+    struct phr_chunked_span span;
+    char *buf = strdup(encoded);
+    size_t off = 0, bufsz, span_off = 0, skipped = 0, num_spans;
+    ssize_t ret;
+
+    dec.consume_trailer = consume_trailer;
+    dec.discard = 1;
+
+    note("testing discard, source at line %d", line);
+
+    /* feed one byte at a time, followed by the rest, checking that the buffer is left untouched */
+    bufsz = 1;
+    if ((ret = phr_decode_chunked(&dec, buf, &bufsz)) == -2) {
+        off = bufsz;
+        bufsz = strlen(encoded) - off;
+        ret = phr_decode_chunked(&dec, buf + off, &bufsz);
+    }
+    off += bufsz;
+    ok(ret == expected);
+    ok(strcmp(buf, encoded) == 0);
+    if (expected >= 0) {
+        ok(off + expected == strlen(encoded));
+        /* the chunk data being skipped is that of the decoded output, as located by decoding the consumed bytes into spans */
+        memset(&dec, 0, sizeof(dec));
+        dec.consume_trailer = consume_trailer;
+        do {
+            bufsz = off - span_off;
+            num_spans = 1;
+            ret = phr_decode_chunked_spans(&dec, encoded + span_off, &bufsz, &span, &num_spans);
+            if (num_spans != 0)
+                skipped += span.len;
+            span_off += bufsz;
+        } while (ret == -2 && span_off != off);
+        ok(ret == 0);
+        ok(span_off == off);
+        ok(skipped == strlen(decoded));
+    }
+
+    free(buf);
+}
+
+/* decodes the input being supplied one byte at a time, collecting the chunk extensions to `exts_buf` separated by "|" */
+static ssize_t decode_chunked_metadata(struct phr_chunked_decoder *dec, const char *encoded, char *decoded, size_t *decoded_len,
+                                       char *exts_buf, struct phr_header *trailers, size_t *num_trailers, size_t *consumed)
+{
+    struct phr_chunked_span spans[4], exts[4];
+    size_t avail = 0, max_trailers = *num_trailers, bufsz, num_spans, num_exts, i;
+    ssize_t ret;
+
+    *decoded_len = 0;
+    *consumed = 0;
+    exts_buf[0] = '\0';
+    do {
+        ++avail;
+        bufsz = avail - *consumed;
+        num_spans = 4;
+        num_exts = 4;
+        *num_trailers = max_trailers;
+        ret = phr_decode_chunked_metadata(dec, encoded + *consumed, &bufsz, spans, &num_spans, exts, &num_exts, trailers,
+                                          num_trailers);
+        for (i = 0; i != num_spans; ++i) {
+            memcpy(decoded + *decoded_len, encoded + *consumed + spans[i].off, spans[i].len);
+            *decoded_len += spans[i].len;
+        }
+        for (i = 0; i != num_exts; ++i)
+            sprintf(exts_buf + strlen(exts_buf), "%.*s|", (int)exts[i].len, encoded + *consumed + exts[i].off);
+        *consumed += bufsz;
+    } while (ret == -2 && avail != strlen(encoded));
+    if (ret >= 0) {
+        /* report the octets that follow the encoded data in the entire input */
+        ok(*consumed + ret == avail);
+        ret = strlen(encoded) - *consumed;
+    }
+    return ret;
+}
+
+static void test_chunked_metadata_runner(int line, int consume_trailer, const char *encoded, const char *decoded, ssize_t expected)
+{
+    struct phr_chunked_decoder dec = {0};
+    struct phr_header trailers[4];
+    char *buf = malloc(strlen(encoded) + 1), exts[256];
+    size_t decoded_len, num_trailers = 4, consumed;
+    ssize_t ret;
+
+    note("testing metadata, source at line %d", line);
+
+    /* the trailers are extracted only when they are to be consumed, as the expectations are */
+    ret = decode_chunked_metadata(&dec, encoded, buf, &decoded_len, exts, consume_trailer ? trailers : NULL, &num_trailers,
+                                  &consumed);
+    ok(ret == expected);
+    ok(bufis(buf, decoded_len, decoded));
+    if (expected >= 0)
+        ok(consumed + expected == strlen(encoded));
+
+    free(buf);
+}
+
 static void test_chunked_failure(int line, const char *encoded, ssize_t expected)
 {
     struct phr_chunked_decoder dec = {0};
@@ -400,7 +1401,8 @@ cleanup:
 }
 
 static void (*chunked_test_runners[])(int, int, const char *, const char *, ssize_t) = {test_chunked_at_once, test_chunked_per_byte,
-                                                                                        NULL};
+                                                                                        test_chunked_spans, test_chunked_discard,
+                                                                                        test_chunked_metadata_runner, NULL};
 
 static void test_chunked(void)
 {
@@ -411,6 +1413,10 @@ static void test_chunked(void)
         chunked_test_runners[i](__LINE__, 0, "6\r\nhello \r\n5\r\nworld\r\n0\r\n", "hello world", 0);
         chunked_test_runners[i](__LINE__, 0, "6;comment=hi\r\nhello \r\n5\r\nworld\r\n0\r\n", "hello world", 0);
         chunked_test_runners[i](__LINE__, 0, "6 ; comment\r\nhello \r\n5\r\nworld\r\n0\r\n", "hello world", 0);
+        chunked_test_runners[i](__LINE__, 0,
+                                "6;name=\"an extension value long enough to be skipped using SIMD\"\r\nhello \r\n"
+                                "5\r\nworld\r\n0\r\n",
+                                "hello world", 0);
         chunked_test_runners[i](__LINE__, 0, "6\r\nhello \r\n5\r\nworld\r\n0\r\na: b\r\nc: d\r\n\r\n", "hello world",
                                 sizeof("a: b\r\nc: d\r\n\r\n") - 1);
         chunked_test_runners[i](__LINE__, 0, "b\r\nhello world\r\n0\r\n", "hello world", 0);
@@ -431,6 +1437,7 @@ static void test_chunked(void)
     test_chunked_failure(__LINE__, "6\r\nhello \r\n5\r\nworld\n0\r\n", -1);
     test_chunked_failure(__LINE__, "6\r\nhello \r\n5\r\nworld\r\n0\n", -1);
     test_chunked_failure(__LINE__, "6\rX\nhello \n5\r\nworld\r\n0\r\n", -1);
+    test_chunked_failure(__LINE__, "6;name=\"an extension value long enough to be skipped using SIMD\"\nhello \r\n", -1);
 }
 
 static void test_chunked_consume_trailer(void)
@@ -443,9 +1450,15 @@ static void test_chunked_consume_trailer(void)
         chunked_test_runners[i](__LINE__, 1, "6;comment=hi\r\nhello \r\n5\r\nworld\r\n0\r\n", "hello world", -2);
         chunked_test_runners[i](__LINE__, 1, "b\r\nhello world\r\n0\r\n\r\n", "hello world", 0);
         chunked_test_runners[i](__LINE__, 1, "6\r\nhello \r\n5\r\nworld\r\n0\r\na: b\r\nc: d\r\n\r\n", "hello world", 0);
+        chunked_test_runners[i](__LINE__, 1,
+                                "6\r\nhello \r\n5\r\nworld\r\n0\r\n"
+                                "x-trailer: a value being long enough to be skipped using SIMD instructions\r\n\r\n",
+                                "hello world", 0);
+#if !STRICT_CRLF
         /* bare lf is allowed in trailers, for consistency to when they are parsed using phr_parse_headers */
         chunked_test_runners[i](__LINE__, 1, "b\r\nhello world\r\n0\r\n\n", "hello world", 0);
         chunked_test_runners[i](__LINE__, 1, "6\r\nhello \r\n5\r\nworld\r\n0\r\na: b\nc: d\n\n", "hello world", 0);
+#endif
     }
 }
 
@@ -515,9 +1528,415 @@ static void test_chunked_overhead(void)
     ok(do_test_chunked_overhead(10, 100000, "; large=aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa") == -1);
 }
 
+/* reads the body from `input` being fed `step` bytes at a time */
+static ssize_t read_body(struct phr_body_reader *reader, const char *input, size_t step, char *body, size_t *body_len,
+                         size_t *consumed)
+{
+    struct phr_chunked_span spans[4];
+    size_t avail = 0, bufsz, num_spans, i;
+    ssize_t ret;
+
+    *body_len = 0;
+    *consumed = 0;
+    do {
+        avail = avail + step < strlen(input) ? avail + step : strlen(input);
+        bufsz = avail - *consumed;
+        num_spans = 4;
+        ret = phr_body_reader_read(reader, input + *consumed, &bufsz, spans, &num_spans);
+        for (i = 0; i != num_spans; ++i) {
+            memcpy(body + *body_len, input + *consumed + spans[i].off, spans[i].len);
+            *body_len += spans[i].len;
+        }
+        *consumed += bufsz;
+    } while (ret == -2 && avail != strlen(input));
+    if (ret >= 0) {
+        /* report the octets that follow the body in the entire input */
+        ok(*consumed + ret == avail);
+        ret = strlen(input) - *consumed;
+    }
+    return ret;
+}
+
+static void test_body_reader(void)
+{
+    struct phr_body_reader reader;
+    struct phr_framing framing = {0};
+    struct phr_chunked_span span;
+    char body[64];
+    size_t body_len, consumed, bufsz, num_spans, step;
+
+    for (step = 1; step <= 64; step *= 4) {
+        note("step %zu", step);
+        phr_body_reader_init(&reader, PHR_BODY_CONTENT_LENGTH, 11);
+        ok(read_body(&reader, "hello worldGET / HTTP/1.1\r\n\r\n", step, body, &body_len, &consumed) == 18);
+        ok(bufis(body, body_len, "hello world"));
+        ok(consumed == 11);
+        ok(phr_body_reader_eof(&reader) == 0);
+
+        phr_body_reader_init(&reader, PHR_BODY_CHUNKED, 0);
+        ok(read_body(&reader, "6\r\nhello \r\n5\r\nworld\r\n0\r\na: b\r\n\r\nGET", step, body, &body_len, &consumed) == 3);
+        ok(bufis(body, body_len, "hello world"));
+        ok(consumed == 32);
+
+        phr_body_reader_init(&reader, PHR_BODY_UNTIL_CLOSE, 0);
+        ok(read_body(&reader, "hello world", step, body, &body_len, &consumed) == -2);
+        ok(bufis(body, body_len, "hello world"));
+        ok(consumed == 11);
+        ok(phr_body_reader_eof(&reader) == 0);
+    }
+
+    phr_body_reader_init(&reader, PHR_BODY_CONTENT_LENGTH, 12);
+    ok(read_body(&reader, "hello world", 64, body, &body_len, &consumed) == -2);
+    ok(consumed == 11);
+    ok(phr_body_reader_eof(&reader) == -1);
+    phr_body_reader_init(&reader, PHR_BODY_CHUNKED, 0);
+    ok(read_body(&reader, "z\r\n", 64, body, &body_len, &consumed) == -1);
+
+    note("no room for spans");
+    phr_body_reader_init(&reader, PHR_BODY_CONTENT_LENGTH, 5);
+    bufsz = 5;
+    num_spans = 0;
+    ok(phr_body_reader_read(&reader, "hello", &bufsz, &span, &num_spans) == -2);
+    ok(bufsz == 0);
+    ok(num_spans == 0);
+
+    note("request framing");
+    phr_body_reader_init_request(&reader, &framing);
+    ok(reader.type == PHR_BODY_NONE);
+    bufsz = 3;
+    num_spans = 1;
+    ok(phr_body_reader_read(&reader, "GET", &bufsz, &span, &num_spans) == 3);
+    ok(bufsz == 0);
+    ok(num_spans == 0);
+    framing.flags = PHR_FRAMING_CONTENT_LENGTH;
+    framing.content_length = 0;
+    phr_body_reader_init_request(&reader, &framing);
+    ok(reader.type == PHR_BODY_NONE);
+    framing.content_length = 5;
+    phr_body_reader_init_request(&reader, &framing);
+    ok(reader.type == PHR_BODY_CONTENT_LENGTH);
+    framing.flags = PHR_FRAMING_TRANSFER_ENCODING | PHR_FRAMING_CHUNKED;
+    phr_body_reader_init_request(&reader, &framing);
+    ok(reader.type == PHR_BODY_CHUNKED);
+
+    note("response framing");
+    phr_body_reader_init_response(&reader, &framing, 200, 0);
+    ok(reader.type == PHR_BODY_CHUNKED);
+    phr_body_reader_init_response(&reader, &framing, 200, 1);
+    ok(reader.type == PHR_BODY_NONE);
+    phr_body_reader_init_response(&reader, &framing, 101, 0);
+    ok(reader.type == PHR_BODY_NONE);
+    phr_body_reader_init_response(&reader, &framing, 204, 0);
+    ok(reader.type == PHR_BODY_NONE);
+    phr_body_reader_init_response(&reader, &framing, 304, 0);
+    ok(reader.type == PHR_BODY_NONE);
+    framing.flags = PHR_FRAMING_TRANSFER_ENCODING;
+    phr_body_reader_init_response(&reader, &framing, 200, 0);
+    ok(reader.type == PHR_BODY_UNTIL_CLOSE);
+    framing.flags = PHR_FRAMING_CONTENT_LENGTH;
+    phr_body_reader_init_response(&reader, &framing, 200, 0);
+    ok(reader.type == PHR_BODY_CONTENT_LENGTH);
+    ok(reader.bytes_left == 5);
+    framing.flags = 0;
+    phr_body_reader_init_response(&reader, &framing, 200, 0);
+    ok(reader.type == PHR_BODY_UNTIL_CLOSE);
+}
+
+/* feeds `input` to the connection `step` bytes at a time, logging the events */
+static int run_conn(struct phr_conn *conn, const char *input, size_t step, char *log, size_t log_size)
+{
+    struct phr_conn_event event;
+    size_t off = 0, len, log_len = 0;
+    char *space;
+    int ret;
+
+    log[0] = '\0';
+    while (1) {
+        while ((ret = phr_conn_next(conn, &event)) >= 0) {
+            switch (ret) {
+            case PHR_CONN_EVENT_REQUEST:
+                log_len += snprintf(log + log_len, log_size - log_len, "[%.*s %.*s%s]", (int)event.request.method_len,
+                                    event.request.method, (int)event.request.path_len, event.request.path,
+                                    event.keep_alive ? "" : " close");
+                break;
+            case PHR_CONN_EVENT_BODY:
+                log_len += snprintf(log + log_len, log_size - log_len, "%.*s", (int)event.body_len, event.body);
+                break;
+            case PHR_CONN_EVENT_BODY_END:
+                log_len += snprintf(log + log_len, log_size - log_len, "|");
+                break;
+            case PHR_CONN_EVENT_CLOSE:
+            case PHR_CONN_EVENT_UPGRADE:
+                return ret;
+            }
+        }
+        if (ret == -1 || off == strlen(input))
+            return ret;
+        if ((space = phr_conn_reserve(conn, &len)) == NULL)
+            return -3;
+        if (len > step)
+            len = step;
+        if (len > strlen(input) - off)
+            len = strlen(input) - off;
+        memcpy(space, input + off, len);
+        phr_conn_received(conn, len);
+        off += len;
+    }
+}
+
+static void test_conn(void)
+{
+    static const char *input = "GET /a HTTP/1.1\r\n\r\n"
+                               "POST /b HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello"
+                               "POST /c HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n2\r\nde\r\n0\r\n\r\n"
+                               "GET /d HTTP/1.0\r\n\r\n";
+    struct phr_conn conn;
+    struct phr_header headers[4];
+    char buf[64], log[256];
+    const char *pending;
+    size_t step, len;
+
+    for (step = 1; step <= 64; step *= 4) {
+        note("step %zu", step);
+        phr_conn_init(&conn, buf, sizeof(buf), headers, 4);
+        ok(run_conn(&conn, input, step, log, sizeof(log)) == PHR_CONN_EVENT_CLOSE);
+        ok(strcmp(log, "[GET /a]|[POST /b]hello|[POST /c]abcde|[GET /d close]|") == 0);
+    }
+
+    note("persistent connection");
+    phr_conn_init(&conn, buf, sizeof(buf), headers, 4);
+    ok(run_conn(&conn, "GET / HTTP/1.0\r\nConnection: keep-alive\r\n\r\nGET /x", 64, log, sizeof(log)) == -2);
+    ok(strcmp(log, "[GET /]|") == 0);
+    pending = phr_conn_pending(&conn, &len);
+    ok(bufis(pending, len, "GET /x"));
+
+    note("switching protocols");
+    phr_conn_init(&conn, buf, sizeof(buf), headers, 4);
+    ok(run_conn(&conn, "CONNECT a:443 HTTP/1.1\r\nHost: a\r\n\r\n\x16\x03\x01GET / HTTP/1.1\r\n\r\n", 64, log, sizeof(log)) ==
+       PHR_CONN_EVENT_UPGRADE);
+    ok(strcmp(log, "[CONNECT a:443]|") == 0);
+    pending = phr_conn_pending(&conn, &len);
+    ok(bufis(pending, len, "\x16\x03\x01GET / HTTP/1.1\r\n\r\n"));
+    ok(run_conn(&conn, "", 64, log, sizeof(log)) == PHR_CONN_EVENT_UPGRADE);
+    phr_conn_init(&conn, buf, sizeof(buf), headers, 4);
+    ok(run_conn(&conn, "GET /ws HTTP/1.1\r\nConnection: Upgrade\r\nUpgrade: websocket\r\n\r\n\x81\x80", 64, log, sizeof(log)) ==
+       PHR_CONN_EVENT_UPGRADE);
+    ok(strcmp(log, "[GET /ws]|") == 0);
+    pending = phr_conn_pending(&conn, &len);
+    ok(bufis(pending, len, "\x81\x80"));
+
+    note("errors");
+    phr_conn_init(&conn, buf, sizeof(buf), headers, 4);
+    ok(run_conn(&conn, "GET / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\n", 64, log, sizeof(log)) == -1);
+    phr_conn_init(&conn, buf, sizeof(buf), headers, 4);
+    ok(run_conn(&conn, "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nz\r\n", 64, log, sizeof(log)) == -1);
+    phr_conn_init(&conn, buf, sizeof(buf), headers, 4);
+    /* request head not fitting in the buffer */
+    ok(run_conn(&conn, "GET / HTTP/1.1\r\nX-Long: aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\r\n\r\n", 16, log, sizeof(log)) == -3);
+}
+
+static void test_chunked_drain(void)
+{
+    struct phr_chunked_decoder dec = {0};
+    struct phr_iovec iov[2];
+    struct phr_body_reader reader;
+    struct phr_conn conn;
+    struct phr_header headers[4];
+    struct phr_conn_event event;
+    char buf[4096], encoded[] = "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\nGET";
+    size_t bufsz, num_spans, i;
+    ssize_t ret;
+
+    note("large chunks are not mistaken as overhead");
+    dec.discard = 1;
+    bufsz = sprintf(buf, "%x\r\n", 1024 * 1024);
+    ok(phr_decode_chunked(&dec, buf, &bufsz) == -2);
+    memset(buf, 'A', sizeof(buf));
+    for (i = 0; i != 1024 * 1024 / sizeof(buf); ++i) {
+        bufsz = sizeof(buf);
+        if ((ret = phr_decode_chunked(&dec, buf, &bufsz)) != -2 || bufsz != sizeof(buf))
+            break;
+    }
+    ok(i == 1024 * 1024 / sizeof(buf));
+    bufsz = sprintf(buf, "\r\n0\r\n");
+    ok(phr_decode_chunked(&dec, buf, &bufsz) == 0);
+    ok(bufsz == 5);
+
+    note("iov");
+    memset(&dec, 0, sizeof(dec));
+    dec.consume_trailer = 1;
+    dec.discard = 1;
+    iov[0].base = encoded;
+    iov[0].len = 12;
+    iov[1].base = encoded + 12;
+    iov[1].len = sizeof(encoded) - 1 - 12;
+    bufsz = 2;
+    ok(phr_decode_chunked_iov(&dec, iov, &bufsz) == 3);
+    ok(bufsz == 2);
+    ok(iov[0].base == encoded + 12 && iov[0].len == 0);
+    ok(iov[1].base == encoded + sizeof(encoded) - 1 - 3 && iov[1].len == 0);
+
+    note("body reader");
+    phr_body_reader_init(&reader, PHR_BODY_CHUNKED, 0);
+    bufsz = sizeof(encoded) - 1;
+    num_spans = 1;
+    ok(phr_body_reader_read(&reader, encoded, &bufsz, NULL, &num_spans) == 3);
+    ok(bufsz == sizeof(encoded) - 1 - 3);
+    ok(num_spans == 0);
+    phr_body_reader_init(&reader, PHR_BODY_CONTENT_LENGTH, 5);
+    bufsz = 8;
+    num_spans = 1;
+    ok(phr_body_reader_read(&reader, "helloGET", &bufsz, NULL, &num_spans) == 3);
+    ok(bufsz == 5);
+    ok(num_spans == 0);
+
+    note("conn");
+    phr_conn_init(&conn, buf, sizeof(buf), headers, 4);
+    bufsz = sprintf(buf, "POST /a HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n%s /b HTTP/1.1\r\n\r\n", encoded);
+    phr_conn_received(&conn, bufsz);
+    ok(phr_conn_next(&conn, &event) == PHR_CONN_EVENT_REQUEST);
+    phr_conn_discard_body(&conn);
+    ok(phr_conn_next(&conn, &event) == PHR_CONN_EVENT_BODY_END);
+    ok(phr_conn_next(&conn, &event) == PHR_CONN_EVENT_REQUEST);
+    ok(phr_conn_next(&conn, &event) == PHR_CONN_EVENT_BODY_END);
+    ok(phr_conn_next(&conn, &event) == -2);
+}
+
+static void test_chunked_metadata(void)
+{
+    static const char *encoded = "6;a=b\r\nhello \r\n5 ; c\r\nworld\r\n0;last\r\nx-checksum: abc\r\ngrpc-status: 0\r\n\r\nGET";
+    struct phr_chunked_decoder dec = {0};
+    struct phr_header trailers[4];
+    struct phr_chunked_span spans[4], exts[1];
+    char decoded[64], exts_buf[64];
+    size_t decoded_len, num_trailers, consumed, bufsz, num_spans, num_exts;
+
+    num_trailers = 4;
+    ok(decode_chunked_metadata(&dec, encoded, decoded, &decoded_len, exts_buf, trailers, &num_trailers, &consumed) == 3);
+    ok(bufis(decoded, decoded_len, "hello world"));
+    ok(strcmp(exts_buf, ";a=b|; c|;last|") == 0);
+    ok(num_trailers == 2);
+    ok(bufis(trailers[0].name, trailers[0].name_len, "x-checksum"));
+    ok(bufis(trailers[0].value, trailers[0].value_len, "abc"));
+    ok(bufis(trailers[1].name, trailers[1].name_len, "grpc-status"));
+    ok(bufis(trailers[1].value, trailers[1].value_len, "0"));
+    ok(consumed == strlen(encoded) - 3);
+
+    note("without trailers");
+    memset(&dec, 0, sizeof(dec));
+    num_trailers = 0;
+    ok(decode_chunked_metadata(&dec, "1\r\na\r\n0\r\n\r\n", decoded, &decoded_len, exts_buf, trailers, &num_trailers,
+                               &consumed) == 0);
+    ok(num_trailers == 0);
+    ok(strcmp(exts_buf, "") == 0);
+
+    note("trailers not fitting");
+    memset(&dec, 0, sizeof(dec));
+    num_trailers = 1;
+    ok(decode_chunked_metadata(&dec, encoded, decoded, &decoded_len, exts_buf, trailers, &num_trailers, &consumed) == -1);
+
+    note("exts running short");
+    memset(&dec, 0, sizeof(dec));
+    bufsz = strlen(encoded);
+    num_spans = 4;
+    num_exts = 1;
+    ok(phr_decode_chunked_metadata(&dec, encoded, &bufsz, spans, &num_spans, exts, &num_exts, NULL, NULL) == -2);
+    ok(bufsz == 15);
+    ok(num_spans == 1);
+    ok(num_exts == 1);
+    ok(bufis(encoded + exts[0].off, exts[0].len, ";a=b"));
+}
+
+static void test_kernel(void)
+{
+    int best = phr_get_kernel();
+
+    note("default kernel is %d", best);
+    ok(PHR_KERNEL_SCALAR <= best && best <= PHR_KERNEL_AVX512);
+    ok(phr_set_kernel(PHR_KERNEL_SCALAR) == 0);
+    ok(phr_get_kernel() == PHR_KERNEL_SCALAR);
+    ok(phr_set_kernel(PHR_KERNEL_AUTO) == 0);
+    ok(phr_get_kernel() == best);
+    ok(phr_set_kernel(PHR_KERNEL_AVX512 + 1) == -1);
+    ok(phr_get_kernel() == best);
+}
+
+/* the expectations follow the policies that the parser has been compiled with (see PHR_STRICT) */
+static void test_policy(void)
+{
+    const char *method, *path;
+    size_t method_len, path_len, num_headers;
+    int minor_version;
+    struct phr_header headers[4];
+    struct phr_lazy_headers lazy;
+    struct collect_headers c = {{{NULL}}, 0, 0, PHR_CB_STOP};
+#define PARSE(s)                                                                                                                   \
+    (num_headers = 4,                                                                                                              \
+     phr_parse_request(s, strlen(s), &method, &method_len, &path, &path_len, &minor_version, headers, &num_headers, 0))
+
+    ok(PARSE("GET / HTTP/1.1\r\nA: b\r\n\r\n") == 24);
+    ok(PARSE("GET / HTTP/1.1\nA: b\r\n\r\n") == (STRICT_CRLF ? -1 : 23));
+    ok(PARSE("GET / HTTP/1.1\r\nA: b\n\r\n") == (STRICT_CRLF ? -1 : 23));
+    ok(PARSE("GET / HTTP/1.1\r\nA: b\r\n\n") == (STRICT_CRLF ? -1 : 23));
+    ok(PARSE("GET / HTTP/1.1\r\nA: b\r\n c\r\n\r\n") == (STRICT_OBS_FOLD ? -1 : 28));
+    ok(PARSE("\r\nGET / HTTP/1.1\r\n\r\n") == (STRICT_EMPTY_LINE ? -1 : 20));
+
+    /* the functions that skip lines without parsing them draw the boundary of the message only where the parser would */
+#define LAZY(s, last_len)                                                                                                          \
+    phr_parse_request_lazy(s, strlen(s), &method, &method_len, &path, &path_len, &minor_version, &lazy, last_len)
+    ok(LAZY("GET / HTTP/1.1\r\nHost: a\n\nXYZ", 0) == (STRICT_CRLF ? -1 : 25));
+    ok(LAZY("GET / HTTP/1.1\r\nA: b\nC: d\r\n\r\n", 0) == (STRICT_CRLF ? -1 : 29));
+    ok(LAZY("GET / HTTP/1.1\r\nA: b\nC: d\r\n\r\n", 28) == (STRICT_CRLF ? -1 : 29));
+    c.action = PHR_CB_SKIP;
+    ok(phr_parse_headers_cb("A: b\r\nC: d\n\r\n", 13, collect_header, &c, 0) == (STRICT_CRLF ? -1 : 13));
+#undef LAZY
+
+#undef PARSE
+}
+
+static void test_stats(void)
+{
+    static const char req[] = "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n";
+    static const struct phr_stats zero_stats;
+    struct phr_stats stats;
+    const char *method, *path;
+    size_t method_len, path_len, num_headers, len = sizeof(req) - 1;
+    int minor_version;
+    struct phr_header headers[4];
+    struct phr_chunked_decoder dec = {0};
+    char chunked[] = "3\r\nabc\r\n0\r\n\r\n";
+    size_t bufsz = sizeof(chunked) - 1;
+
+#define PARSE(len, last_len)                                                                                                       \
+    (num_headers = 4,                                                                                                              \
+     phr_parse_request(req, len, &method, &method_len, &path, &path_len, &minor_version, headers, &num_headers, last_len))
+
+    dec.consume_trailer = 1;
+    phr_reset_stats();
+    ok(PARSE(len - 2, 0) == -2);
+    ok(PARSE(len - 1, len - 2) == -2);
+    ok(PARSE(len, len - 1) == (int)len);
+    ok(phr_decode_chunked(&dec, chunked, &bufsz) == 0);
+    phr_get_stats(&stats);
+#ifdef PHR_ENABLE_STATS
+    ok(stats.simd_bytes + stats.swar_bytes + stats.tail_bytes != 0);
+    ok(stats.partial_returns == 2);
+    /* three bytes preceding `last_len` are checked by the second call, the third call checks them and parses the whole request */
+    ok(stats.rescanned_bytes == 3 + 3 + len - 1);
+    ok(stats.incomplete_rejections == 1);
+    ok(stats.chunked_memmove_bytes == 3);
+    phr_reset_stats();
+    phr_get_stats(&stats);
+#endif
+    ok(memcmp(&stats, &zero_stats, sizeof(stats)) == 0);
+
+#undef PARSE
+}
+
 int main(void)
 {
     long pagesize = sysconf(_SC_PAGESIZE);
+    int kernel;
     assert(pagesize >= 1);
 
     inputbuf = mmap(NULL, pagesize * 3, PROT_NONE, MAP_ANON | MAP_PRIVATE, -1, 0);
@@ -525,13 +1944,39 @@ int main(void)
     inputbuf += pagesize * 2;
     ok(mprotect(inputbuf - pagesize, pagesize, PROT_READ | PROT_WRITE) == 0);
 
-    subtest("request", test_request);
-    subtest("response", test_response);
-    subtest("headers", test_headers);
-    subtest("chunked", test_chunked);
-    subtest("chunked-consume-trailer", test_chunked_consume_trailer);
-    subtest("chunked-leftdata", test_chunked_leftdata);
-    subtest("chunked-overhead", test_chunked_overhead);
+    subtest("kernel", test_kernel);
+    subtest("stats", test_stats);
+    subtest("policy", test_policy);
+
+    for (kernel = PHR_KERNEL_SCALAR; kernel <= PHR_KERNEL_AVX512; ++kernel) {
+        if (phr_set_kernel(kernel) != 0) {
+            note("kernel %d is not available", kernel);
+            continue;
+        }
+        note("using kernel %d", kernel);
+        subtest("request", test_request);
+        subtest("response", test_response);
+        subtest("headers", test_headers);
+        subtest("find-headers-end", test_find_headers_end);
+        subtest("incremental", test_incremental);
+        subtest("header-ids", test_header_ids);
+        subtest("framing", test_framing);
+        subtest("batch", test_batch);
+        subtest("compact", test_compact);
+        subtest("callback", test_callback);
+        subtest("selective", test_selective);
+        subtest("lazy", test_lazy);
+        subtest("iov", test_iov);
+        subtest("chunked", test_chunked);
+        subtest("chunked-consume-trailer", test_chunked_consume_trailer);
+        subtest("chunked-leftdata", test_chunked_leftdata);
+        subtest("chunked-overhead", test_chunked_overhead);
+        subtest("chunked-drain", test_chunked_drain);
+        subtest("chunked-metadata", test_chunked_metadata);
+        subtest("body-reader", test_body_reader);
+        subtest("conn", test_conn);
+    }
+    phr_set_kernel(PHR_KERNEL_AUTO);
 
     munmap(inputbuf - pagesize * 2, pagesize * 3);
 
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2009-2014 Kazuho Oku, Tokuhiro Matsuno, Daisuke Murase,
+ *                         Shigeo Mitsunari
+ *
+ * The software is licensed under either the MIT License (below) or the Perl
+ * license.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include "picotest/picotest.h"
+#include "picohttpparser.hpp"
+
+static void test_request(void)
+{
+    phr::Request<2> req;
+
+    ok(req.parse("GET /a HTTP/1.1\r\nHost: example.com\r\nx-foo: bar\r\n\r\n").complete());
+    ok(req.method() == "GET");
+    ok(req.path() == "/a");
+    ok(req.minor_version() == 1);
+    ok(req.headers().size() == 2);
+    ok(req.headers().find("HOST") == "example.com");
+    ok(req.headers()[1].name == "x-foo");
+
+    /* the headers parsed before stopping are not exposed */
+    ok(req.parse("GET /a HTTP/1.1\r\nHost: example.com\r\n").incomplete());
+    ok(req.headers().empty());
+    ok(req.parse("GET /a HTTP/1.1\r\nA: b\r\nC: d\r\nE: f\r\n\r\n").error());
+    ok(req.headers().empty());
+    ok(req.headers().begin() == req.headers().end());
+    ok(!req.headers().find("a"));
+}
+
+static void test_response(void)
+{
+    phr::Response<2> res;
+
+    ok(res.parse("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n").consumed == 38);
+    ok(res.status() == 200);
+    ok(res.message() == "OK");
+    ok(res.headers().find("content-length") == "5");
+
+    ok(res.parse("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\001").error());
+    ok(res.headers().empty());
+}
+
+static void test_headers(void)
+{
+    phr::Headers<4> headers;
+
+    ok(headers.parse("A: b\r\n c\r\n\r\n").complete());
+    ok(headers.size() == 2);
+    ok(headers[1].name.empty());
+    ok(headers[1].value == " c");
+
+    ok(headers.parse("A: b\r\nC: d\r\n", 6).incomplete());
+    ok(headers.empty());
+}
+
+int main(void)
+{
+    subtest("request", test_request);
+    subtest("response", test_response);
+    subtest("headers", test_headers);
+    return done_testing();
+}